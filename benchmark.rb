@@ -0,0 +1,101 @@
+# Benchmarks the wrapper against the simulated board, so it runs anywhere:
+#
+#   K8055_TRANSPORT=sim ruby -I. benchmark.rb      (or `make bench`)
+#
+# Prints ops/sec and p50/p99 latency per operation. The simulated transfer
+# latency defaults to 0 (pure library overhead); set K8055_SIM_LATENCY_US,
+# K8055_SIM_JITTER_US and K8055_SIM_FAILURE_RATE to model a real bus, and
+# BENCH_SECONDS to change how long each operation runs (default 1).
+
+require 'rubyk8055'
+include USB
+
+SECONDS = (ENV['BENCH_SECONDS'] || 1).to_f
+
+def clock
+  Process.clock_gettime(Process::CLOCK_MONOTONIC)
+end
+
+def percentile(sorted, p)
+  sorted[[(sorted.size * p).ceil - 1, 0].max]
+end
+
+def bench(name, ops_per_call = 1)
+  times = []
+  start = clock
+  finish = start + SECONDS
+  now = start
+  while now < finish
+    before = now
+    yield
+    now = clock
+    times << now - before
+  end
+  times.sort!
+  printf("%-28s %12.0f %12.1f %12.1f\n", name, times.size * ops_per_call / (now - start),
+         percentile(times, 0.50) * 1e6, percentile(times, 0.99) * 1e6)
+end
+
+@r = RubyK8055.new
+@r.connect(0, ENV['K8055_TRANSPORT'] || :sim) or abort "no board to benchmark"
+@r.sim_inputs(0b10101, 128, 64)
+
+printf("%-28s %12s %12s %12s\n", "operation", "ops/sec", "p50 us", "p99 us")
+
+bench("get_digital") { @r.get_digital(1) }
+bench("get_analog") { @r.get_analog(1) }
+bench("read_counter") { @r.read_counter(1) }
+bench("all_inputs") { @r.all_inputs }
+bench("snapshot") { @r.snapshot }
+bench("read_raw") { @r.read_raw }
+packed = "\0" * RubyK8055::PACKED_SIZE
+bench("read_into") { @r.read_into(packed) }
+bench("acquire x100", 100) { @r.acquire(count: 100, interval_us: 0) }
+# writes that change nothing are skipped, so alternate the values
+toggle = false
+bench("set_digital") { @r.set_digital(1, toggle = !toggle) }
+bench("set_digital (no change)") { @r.set_digital(1, true) }
+bench("set_analog") { @r.set_analog(1, (toggle = !toggle) ? 200 : 100) }
+bench("write_all_digital") { @r.write_all_digital((toggle = !toggle) ? 0x55 : 0xaa) }
+bench("reset_counter") { @r.reset_counter(1) }
+
+# output bursts: 8 digital + 2 analog changes per call
+bench("burst x10", 10) do
+  toggle = !toggle
+  1.upto(8) { |i| @r.set_digital(i, toggle) }
+  1.upto(2) { |i| @r.set_analog(i, toggle ? 255 : 0) }
+end
+bench("burst x10 (batch)", 10) do
+  toggle = !toggle
+  @r.batch do |b|
+    1.upto(8) { |i| b.set_digital(i, toggle) }
+    1.upto(2) { |i| b.set_analog(i, toggle ? 255 : 0) }
+  end
+end
+@r.write_mode = :no_confirm
+bench("burst x10 (no_confirm)", 10) do
+  toggle = !toggle
+  1.upto(8) { |i| @r.set_digital(i, toggle) }
+  1.upto(2) { |i| @r.set_analog(i, toggle ? 255 : 0) }
+end
+@r.write_mode = :confirm
+@r.async_output = true
+bench("burst x10 (async)", 10) do
+  toggle = !toggle
+  1.upto(8) { |i| @r.set_digital(i, toggle) }
+  1.upto(2) { |i| @r.set_analog(i, toggle ? 255 : 0) }
+end
+@r.flush
+@r.async_output = false
+
+@r.start_acquisition
+sleep 0.05
+bench("snapshot (acquiring)") { @r.snapshot }
+bench("get_digital (acquiring)") { @r.get_digital(1) }
+# per-call overhead of the binding itself: neither touches the bus
+bench("get_digital (acquiring) x100", 100) { 100.times { @r.get_digital(1) } }
+@r.digital_on(1)
+bench("digital_on (no change) x100", 100) { 100.times { @r.digital_on(1) } }
+@r.stop_acquisition
+
+@r.disconnect
@@ -2,73 +2,41 @@ require 'rubyk8055'
 include USB
 @r = RubyK8055.new
 @r.connect
+# the chaser only writes, so don't wait for a packet back after each step
+@r.write_mode = :no_confirm
+@r.on_write_error { |n| warn "#{n} output packets lost" }
 
 delay = 0.025
 
-while true
-  2.times do
-    1.upto 10 do |i|
-      if i <= 8
-        @r.set_digital i, true
-        sleep delay
-        @r.set_digital i, false
-      else
-        @r.set_analog_max i - 8
-        sleep delay
-        @r.set_analog_min i - 8
-      end
-    end
-  end
+# The light show as output frames: [digital, analog1, analog2, seconds].
+# Outputs 1-8 are the digital bits, 9 and 10 the two analog channels.
+def frame(outputs, delay)
+  digital = outputs.select { |o| o <= 8 }.inject(0) { |d, o| d | 1 << (o - 1) }
+  [digital, outputs.include?(9) ? 255 : 0, outputs.include?(10) ? 255 : 0, delay]
+end
 
-  2.times do
-    1.upto 10 do |i|
-      if i <= 8
-        @r.set_digital i, true
-        sleep delay
-      else
-        @r.set_analog_max i - 8
-        sleep delay
-      end
-    end
-    @r.clear_all_digital
-    @r.clear_all_analog
-  end
+frames = []
 
-  2.times do
-    10.downto 1 do |i|
-      if i <= 8
-        @r.set_digital i, true
-        sleep delay
-        @r.set_digital i, false
-      else
-        @r.set_analog_max i - 8
-        sleep delay
-        @r.set_analog_min i - 8
-      end
-    end
-  end
+# one output at a time
+chase = lambda do |order|
+  order.each { |i| frames << frame([i], delay) }
+end
 
-  5.times do
-    1.upto 10 do |i|
-      if i <= 8
-        @r.set_digital i, true
-        sleep delay
-      else
-        @r.set_analog_max i - 8
-        sleep delay
-      end
-    end
+# switch the outputs on one after another, then (if empty) off again
+fill = lambda do |empty|
+  on = []
+  1.upto(10) { |i| frames << frame(on << i, delay) }
+  1.upto(10) { |i| on.delete(i); frames << frame(on, delay) } if empty
+end
 
-    1.upto 10 do |i|
-      if i <= 8
-        @r.set_digital i, false
-        sleep delay
-      else
-        @r.set_analog_min i - 8
-        sleep delay
-      end
-    end
-  end
+2.times { chase.call(1..10) }
+2.times { fill.call(false); frames << [0, 0, 0, 0] }
+2.times { chase.call(10.downto(1)) }
+5.times { fill.call(true) }
 
+# played on a native timer, so GC and scheduling don't stretch the steps
+@r.play_sequence(frames, true)
+loop do
+  sleep 10
+  puts "frame #{@r.sequence_position}, #{@r.missed_deadlines} missed deadlines"
 end
-
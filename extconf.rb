@@ -7,8 +7,23 @@ extension_name = 'rubyk8055'
 # The destination
 dir_config('rubyk8055')
 
-have_library("usb")
+# Transports: Linux hidraw (no library, leaves the HID driver bound),
+# libusb-0.1 (synchronous) and libusb-1.0 (asynchronous). Each is compiled in
+# when its header or library is found.
+have_header("linux/hidraw.h")
+$defs << "-DHAVE_USB_H" if have_library("usb", "usb_init", "usb.h")
+pkg_config("libusb-1.0")
+$defs << "-DHAVE_LIBUSB_H" if have_library("usb-1.0", "libusb_init", "libusb.h")
+have_library("pthread")
+# RubyK8055#read_into can fill an IO::Buffer as well as a String
+have_func("rb_io_buffer_get_bytes_for_writing", "ruby/io/buffer.h")
 
 # Do the work
 create_makefile('rubyk8055')
 
+
+# `make bench` runs benchmark.rb against the simulated board
+File.open("Makefile", "a") do |makefile|
+  makefile.puts "\nbench: $(DLLIB)"
+  makefile.puts "\tK8055_TRANSPORT=sim $(RUBY) -I. $(srcdir)/benchmark.rb"
+end
@@ -1,27 +1,183 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include <usb.h>
 #include <assert.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+/* opaque per-board context, one per open K8055 */
+typedef struct k8055_dev k8055_dev;
+
+/* cancels a single WaitSampleNewer(), AcquireSamples() or FlushOutputs()
+   call: zero it, pass it in, and CancelWait() it from another thread. A
+   call given one ignores InterruptDevice(), which is meant for transfers. */
+typedef struct
+{
+    atomic_int cancelled;
+} k8055_cancel;
+
+/* write modes, see SetWriteMode() */
+#define K8055_WRITE_CONFIRM     0   /* read a packet back after every write (default) */
+#define K8055_WRITE_NO_CONFIRM  1   /* send and return, no read back */
+#define K8055_WRITE_DEFERRED    2   /* the next input read confirms the write */
+
+typedef void (*k8055_write_error_cb)(k8055_dev *k, unsigned char cmd, void *data);
+
+/* one raw 8-byte input packet and when it was received */
+typedef struct
+{
+    uint64_t timestamp;         /* CLOCK_MONOTONIC, nanoseconds */
+    unsigned char packet[8];
+    unsigned char digital;      /* digital inputs after debouncing, input 1 = bit 0 */
+} k8055_sample;
+
+/* a digital input transition, see WaitEdges() */
+typedef struct
+{
+    uint64_t timestamp;         /* CLOCK_MONOTONIC of the packet that showed it */
+    int channel;                /* 1-5 */
+    int rising;                 /* 1 went high, 0 went low */
+} k8055_edge;
+
+/* one step of an output sequence, see PlaySequence() */
+typedef struct
+{
+    unsigned char digital;      /* digital outputs, output 1 = bit 0 */
+    unsigned char analog1, analog2;
+    unsigned long duration_us;  /* how long to hold it before the next frame */
+} k8055_frame;
+
+/* timing of a bulk acquisition, see AcquireSamples(). Lateness is how long
+   after its scheduled time each sample's packet arrived. */
+typedef struct
+{
+    unsigned long count;        /* samples taken */
+    unsigned long missed;       /* reads that ran past the next sample's deadline */
+    uint64_t lateness_max_ns;
+    double lateness_mean_ns, lateness_stddev_ns;
+    uint64_t next_deadline;     /* when a following sample would be due, to continue the schedule */
+} k8055_acquire_stats;
+
+/* filtered view of one analog input, see SetAnalogFilter(). Windowed values
+   cover the last `samples` packets. */
+#define K8055_FILTER_MAX_WINDOW 1024
+typedef struct
+{
+    unsigned long samples;      /* packets in the window, 0 until the first one */
+    double mean, stddev;        /* moving average and its standard deviation */
+    double median;
+    long min, max;
+    double smoothed;            /* exponential moving average */
+} k8055_analog_stats;
+
+/* a capture file opened for reading, see OpenRecording() */
+typedef struct k8055_recording k8055_recording;
+
+/* transfer latency histogram: bucket i counts transfers that took at most
+   K8055_HIST_BOUNDS_US[i] microseconds, the last bucket everything slower */
+#define K8055_HIST_BUCKETS 12
+#define K8055_HIST_BOUNDS_US { 50, 100, 250, 500, 1000, 2500, 5000, 10000, 20000, 50000, 100000 }
+
+/* counters for one direction, see GetStats() */
+typedef struct
+{
+    unsigned long transfers;        /* packets handed to the transport */
+    unsigned long retries;          /* transfers after the first in one call */
+    unsigned long timeouts;         /* transfers that timed out */
+    unsigned long short_packets;    /* transfers that moved less than 8 bytes */
+    unsigned long errors;           /* transfers that failed any other way */
+    unsigned long failures;         /* calls that gave up after every retry */
+    unsigned long skipped;          /* input packets a newer one replaced before
+                                       they were read (libusb1, hidraw) */
+    uint64_t time_ns;               /* total time spent in transfers */
+    unsigned long histogram[K8055_HIST_BUCKETS];
+} k8055_transfer_stats;
+
+typedef struct
+{
+    k8055_transfer_stats read, write;
+} k8055_stats;
 
 /* prototypes */
-int OpenDevice(long board_address);
-int CloseDevice();
-long ReadAnalogChannel(long Channelno);
-int ReadAllAnalog(long* data1, long* data2);
-int OutputAnalogChannel(long channel, long data);
-int OutputAllAnalog(long data1,long data2);
-int ClearAllAnalog();
-int ClearAnalogChannel(long channel);
-int SetAnalogChannel(long channel);
-int SetAllAnalog();
-int WriteAllDigital(long data);
-int ClearDigitalChannel(long channel);
-int ClearAllDigital();
-int SetDigitalChannel(long channel);
-int SetAllDigital();
-int ReadDigitalChannel(long channel);
-long ReadAllDigital();
-int ResetCounter(long counternr);
-long ReadCounter(long counterno);
-int SetCounterDebounceTime(long counterno, long debouncetime);
+k8055_dev *NewDevice(void);
+void FreeDevice(k8055_dev *k);
+int OpenDevice(k8055_dev *k, long board_address);
+int OpenDeviceWith(k8055_dev *k, long board_address, const char *transport);
+int CloseDevice(k8055_dev *k);
+void SetAutoReconnect(k8055_dev *k, int enable);
+int GetAutoReconnect(k8055_dev *k);
+unsigned long GetReconnects(k8055_dev *k);
+long ReadAnalogChannel(k8055_dev *k, long Channelno);
+int ReadAllAnalog(k8055_dev *k, long* data1, long* data2);
+int SetAnalogFilter(k8055_dev *k, long channel, unsigned long window, double alpha);
+int ReadAnalogFilter(k8055_dev *k, long channel, k8055_analog_stats *stats);
+int OutputAnalogChannel(k8055_dev *k, long channel, long data);
+int OutputAllAnalog(k8055_dev *k, long data1,long data2);
+int ClearAllAnalog(k8055_dev *k);
+int GetOutputs(k8055_dev *k, long *digital, long *analog1, long *analog2);
+unsigned long GetWritesSkipped(k8055_dev *k);
+int ClearAnalogChannel(k8055_dev *k, long channel);
+int SetAnalogChannel(k8055_dev *k, long channel);
+int SetAllAnalog(k8055_dev *k);
+int WriteAllDigital(k8055_dev *k, long data);
+int ClearDigitalChannel(k8055_dev *k, long channel);
+int ClearAllDigital(k8055_dev *k);
+int SetDigitalChannel(k8055_dev *k, long channel);
+int SetAllDigital(k8055_dev *k);
+int ReadDigitalChannel(k8055_dev *k, long channel);
+long ReadAllDigital(k8055_dev *k);
+int ReadAllValues(k8055_dev *k, long* data1, long* data2, long* data3, long* data4, long* data5);
+int ReadSample(k8055_dev *k, k8055_sample *sample);
+long DecodeDigital(const unsigned char *packet);
+void DecodeValues(const unsigned char *packet, long* data1, long* data2, long* data3, long* data4, long* data5);
+int SetDigitalDebounce(k8055_dev *k, long channel, long time_us, unsigned long samples);
+int GetDigitalDebounce(k8055_dev *k, long channel, long *time_us, unsigned long *samples);
+unsigned long GetDigitalGlitches(k8055_dev *k);
+void SetReadCacheAge(k8055_dev *k, long max_age_us);
+long GetReadCacheAge(k8055_dev *k);
+int SetWriteMode(k8055_dev *k, int mode);
+int GetWriteMode(k8055_dev *k);
+unsigned long GetWriteErrors(k8055_dev *k);
+void GetStats(k8055_dev *k, k8055_stats *stats);
+void ResetStats(k8055_dev *k);
+void SetWriteErrorCallback(k8055_dev *k, k8055_write_error_cb cb, void *data);
+int SetAsyncOutput(k8055_dev *k, int enable);
+int GetAsyncOutput(k8055_dev *k);
+int FlushOutputs(k8055_dev *k, long timeout_ms, k8055_cancel *cancel);
+void BeginOutputBatch(k8055_dev *k);
+int EndOutputBatch(k8055_dev *k);
+int ResetCounter(k8055_dev *k, long counternr);
+long ReadCounter(k8055_dev *k, long counterno);
+int ReadCounterTotal(k8055_dev *k, long counterno, uint64_t *total);
+double ReadCounterRate(k8055_dev *k, long counterno, double window_s);
+int SetCounterDebounceTime(k8055_dev *k, long counterno, long debouncetime);
+int StartAcquisition(k8055_dev *k);
+int StopAcquisition(k8055_dev *k);
+int IsAcquiring(k8055_dev *k);
+void InterruptDevice(k8055_dev *k);
+void ClearInterrupt(k8055_dev *k);
+void CancelWait(k8055_dev *k, k8055_cancel *cancel);
+int ReadLatestSample(k8055_dev *k, k8055_sample *sample);
+int WaitSampleNewer(k8055_dev *k, k8055_sample *sample, uint64_t after, long timeout_ms,
+                    k8055_cancel *cancel);
+long AcquireSamples(k8055_dev *k, k8055_sample *samples, unsigned long count,
+                    unsigned long interval_us, uint64_t start, k8055_acquire_stats *stats,
+                    k8055_cancel *cancel);
+int WatchEdges(k8055_dev *k, int enable);
+int WaitEdges(k8055_dev *k, k8055_edge *edges, int max, long timeout_ms);
+void CancelEdgeWait(k8055_dev *k);
+unsigned long GetEdgesDropped(k8055_dev *k);
+int PlaySequence(k8055_dev *k, const k8055_frame *frames, unsigned long count, int loop);
+int StopSequence(k8055_dev *k);
+int SeekSequence(k8055_dev *k, unsigned long frame);
+int SequenceStatus(k8055_dev *k, unsigned long *frame, unsigned long *missed);
+int StartCapture(k8055_dev *k, const char *path, unsigned long records);
+int StopCapture(k8055_dev *k);
+k8055_recording *OpenRecording(const char *path);
+int NextRecordedSample(k8055_recording *r, k8055_sample *sample);
+void CloseRecording(k8055_recording *r);
+int ConfigureSimulator(k8055_dev *k, long latency_us, long jitter_us, double failure_rate);
+int SimulateInputs(k8055_dev *k, long digital, long analog1, long analog2);
+int SimulateCounterPulses(k8055_dev *k, long counterno, long pulses);
+int SimulateUnplug(k8055_dev *k, long ms);
+int SimulatedOutputs(k8055_dev *k, long *digital, long *analog1, long *analog2);
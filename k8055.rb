@@ -1,27 +1,35 @@
 #!/usr/bin/env ruby
 
-__doc__ = """
-Ruby version of K8055 command line program
+USAGE = <<EOT
+Ruby version of K8055 command line program, and a multi-board logger
 
 Copyright (C) 2010 by Nathan D. Broadbent
 
-Syntax : ruby k8055.rb [-p:(number)] [-d:(value)] [-a1:(value)] [-a2:(value)]
-             [-num:(number) [-delay:(number)] [-dbt1:(value)]
-             [-dbt2:(value)] [-reset1] [-reset2] [-debug] [-h|--help]
-	-p:(number)	Set board number (0/1/2/3)
+Syntax : ruby k8055.rb [-p:(number)[,(number)...]] [-d:(value)] [-a1:(value)] [-a2:(value)]
+             [-num:(number)] [-delay:(number)] [-dbt1:(value)] [-dbt2:(value)]
+             [-reset1] [-reset2] [-format:csv|bin] [-out:(file)] [-h|--help]
+	-p:(number)	Set board number (0/1/2/3), or several: -p:0,1,2
 	-d:(value)	Set digital output value (bitmask, 8 bits in decimal)
 	-a1:(value)	Set analog output 1 value (0-255)
 	-a2:(value)	Set analog output 2 value (0-255)
-	-num:(number)   Set number of measures (-1 for no read)
-	-delay:(number) Set delay between two measures (in msec)
+	-num:(number)   Set number of measures per board (-1 for no read)
+	-delay:(number) Set delay between two measures (in msec, 0 for as fast as the board answers)
 	-dbt1:(value)   Set debounce time for counter 1 (in msec)
 	-dbt2:(value)   Set debounce time for counter 2 (in msec)
 	-reset1		Reset counter 1
 	-reset2		Reset counter 2
-	-debug		Activate debug mode
+	-format:csv	Write one line per measure (default):
+			time (ms since the first measure);board;d1;d2;d3;d4;d5;a1;a2;c1;c2
+	-format:bin	Write 16-byte records, RubyK8055::PACKED_FORMAT with the pad
+			byte (offset 11) holding the board number
+	-out:(file)	Write the measures to file instead of stdout
 	-h or --help	Print this text
 
+Every board given with -p gets the same settings and is sampled on a thread
+of its own; the measures of all boards are merged into one time-ordered stream.
+
 Example : ruby k8055.rb -p:1 -d:147 -a1:25 -a2:203
+          ruby k8055.rb -p:0,1 -num:10000 -delay:2 -out:log.csv
 
 NOTE:
 	Because of the nature of commands sent to the K8055 board, this
@@ -30,96 +38,163 @@ NOTE:
 	state - and set a new state - of the analog and digital outputs
 
 	See header of libk8055.c for more details of K8055 commands
-"""
+EOT
 
 require 'rubyk8055'
-@r = RubyK8055.new
+include USB
+
+# Each board thread samples this long per native call (RubyK8055#acquire), and
+# the merged stream is written in batches of about as long.
+CHUNK_SECONDS = 0.1
+MAX_CHUNK = 4096
+
+def parse(argv)
+	opts = { :boards => [0], :count => 1, :delay => 0, :format => "csv" }
+	argv.each do |arg|
+		case arg
+		when /\A-p:(\d(,\d)*)\z/   then opts[:boards] = $1.split(",").map(&:to_i).uniq
+		when /\A-d:(\d+)\z/        then opts[:digital] = $1.to_i
+		when /\A-a1:(\d+)\z/       then opts[:analog1] = $1.to_i
+		when /\A-a2:(\d+)\z/       then opts[:analog2] = $1.to_i
+		when /\A-num:(-?\d+)\z/    then opts[:count] = $1.to_i
+		when /\A-delay:(\d+)\z/    then opts[:delay] = $1.to_i
+		when /\A-dbt1:(\d+)\z/     then opts[:debounce1] = $1.to_i
+		when /\A-dbt2:(\d+)\z/     then opts[:debounce2] = $1.to_i
+		when "-reset1"             then opts[:reset1] = true
+		when "-reset2"             then opts[:reset2] = true
+		when /\A-format:(csv|bin)\z/ then opts[:format] = $1
+		when /\A-out:(.+)\z/       then opts[:out] = $1
+		when "-h", "--help"        then print USAGE; exit
+		else abort USAGE
+		end
+	end
+	opts
+end
+
+# Samples one board on its own thread and hands the measures over in chunks.
+# Consecutive chunks continue one acquisition schedule, so the interval holds
+# across chunk boundaries. If the board fails, its stream ends there and the
+# exception is kept in error.
+class BoardLog
+	attr_reader :address, :error
+
+	def initialize(board, address, count, interval_us)
+		@address = address
+		@chunks = Queue.new
+		per_chunk = interval_us > 0 ? (CHUNK_SECONDS * 1e6 / interval_us).ceil : MAX_CHUNK
+		per_chunk = per_chunk.clamp(1, MAX_CHUNK)
+		@thread = Thread.new do
+			begin
+				left, start = count, nil
+				while left > 0
+					run = board.acquire(:count => [left, per_chunk].min, :interval_us => interval_us, :start => start)
+					break unless run && run[:count] > 0
+					@chunks << run
+					left -= run[:count]
+					start = run[:next]
+				end
+			rescue StandardError => e
+				@error = e
+			ensure
+				@chunks << nil
+			end
+		end
+		@pos = @size = 0
+	end
+
+	# Waits for the next chunk once the current one is used up. False when the
+	# board has no more measures.
+	def fill
+		return true if @pos < @size
+		run = @chunks.pop or return false
+		@times = run[:timestamps].unpack("Q<*")
+		@digital = run[:digital].unpack("C*")
+		@analog1 = run[:analog1].unpack("C*")
+		@analog2 = run[:analog2].unpack("C*")
+		@counter1 = run[:counter1].unpack("S<*")
+		@counter2 = run[:counter2].unpack("S<*")
+		@pos, @size = 0, @times.size
+		true
+	end
+
+	def pending?
+		@pos < @size
+	end
+
+	def time
+		@times[@pos]
+	end
+
+	# Appends the current measure to buffer and moves on. Returns false when
+	# that used up the chunk.
+	def write_csv(buffer, t0)
+		d = @digital[@pos]
+		buffer << format("%.3f;%d;%d;%d;%d;%d;%d;%d;%d;%d;%d\n", (@times[@pos] - t0) / 1e6, @address,
+		                 d & 1, (d >> 1) & 1, (d >> 2) & 1, (d >> 3) & 1, (d >> 4) & 1,
+		                 @analog1[@pos], @analog2[@pos], @counter1[@pos], @counter2[@pos])
+		(@pos += 1) < @size
+	end
+
+	def write_bin(buffer, t0)
+		[@times[@pos], @digital[@pos], @analog1[@pos], @analog2[@pos], @address,
+		 @counter1[@pos], @counter2[@pos]].pack("Q<CCCCS<S<", :buffer => buffer)
+		(@pos += 1) < @size
+	end
+end
 
+# k-way merge of the boards' measures by timestamp. A measure is only written
+# once every board still running has a later one (or has finished), and each
+# batch goes out in a single write.
+def merge(logs, out, format)
+	writer = format == "bin" ? :write_bin : :write_csv
+	live = logs.select(&:fill)
+	t0 = live.map(&:time).min
+	buffer = String.new(:encoding => Encoding::BINARY)
+	until live.empty?
+		buffer.clear
+		while live.min_by(&:time).send(writer, buffer, t0)
+		end
+		out.write(buffer)
+		live = live.select { |log| log.pending? || log.fill }
+	end
+	out.flush
+end
 
 def main(argv)
-	# preset values
-	p , db = 0,0		# Port, debug
-	r1, r2 = 0,0		# reset1, reset2
-	dl = -1			# delay
-	db1,db2 = -1,-1		# debounce1, debounce2
-	a1,a2,d = -1,-1,-1	# analog1, analog2, digital
-	nm = 1			# number of times to read, default once
-
-	if argv.include?("-h") or argv.include?("--help")
-		print __doc__
-		exit
-  end
-
-	# not the standard getopts way, but...
-	for arg in argv
-		if arg[:4] == "-a1:"
-		  a1  = int(arg[4:])
-		elsif arg[:4] == "-a2:"
-		  a2  = int(arg[4:])
-		elsif arg[:5] == "-num:"
-		  nm  = int(arg[5:])
-		elsif arg[:3] == "-d:"
-		  d   = int(arg[3:])
-		elsif arg[:3] == "-p:"
-		  p   = int(arg[3:])
-		elsif arg[:7] == "-delay:"
-		  dl  = int(arg[7:])
-		elsif arg[:6] == "-dbt1:"
-		  db1 = int(arg[6:])
-		elsif arg[:6] == "-dbt2:"
-		  db2 = int(arg[6:])
-		elsif arg     == "-reset1"
-		  r1  = 1
-		elsif arg     == "-reset2"
-		  r2  = 1
-		elsif arg     == "-debug"
-		  db  = 1
-		else
-			puts __doc__
-			exit
-	  end
-  end
-
-	begin
-		# Open device
-		k = RubyK8055
-    if k.connect p
-
-		  # set requested
-		  k.reset_counter(1) if r1  !=  0
-		  k.reset_counter(2) if r2  !=  0
-		  k.write_all_digital(d) if d   != -1
-		  k.set_analog(1,a1) if a1  != -1
-		  k.set_analog(2,a2) if a2  != -1
-		  k.set_debounce(1, db1) if db1 != -1
-		  k.set_debounce(2, db2) if db2 != -1
-
-		  # Now we loop (or not) for the specified number of times
-		  # reading all the input values
-
-		  # Each read of all values will take about 8ms, at least
-		  # on my setup - so no sense in using delay less than 10
-		  dl = 10 if (dl > 0) && (dl < 10)
-
-		  if (nm > 0) && (dl > 0)
-			  tst = Time.now
-			  while nm > 0
-				  ds = str(k)
-				  tnow = Time.now
-				  tms = (tnow - tst)
-				  tst = tnow
-				  print str(int(tms+0.4999))+";"+ds
-				  sleep((dl-8)/1000.0)	# compensate for read time
-				  nm -= 1
-    		end
-		  elsif nm > 0
-			  ds = str(k)
-			  print "0;"+ds
-    	end
-
-		  k.disconnect
-    end
+	opts = parse(argv)
+
+	out = opts[:out] ? File.open(opts[:out], "wb") : $stdout.binmode
+	out.sync = false
+
+	boards = opts[:boards].map do |address|
+		k = RubyK8055.new
+		begin
+			k.connect(address)
+		rescue RubyK8055::Error, ArgumentError => e
+			abort e.message
+		end
+		# set requested
+		k.reset_counter(1) if opts[:reset1]
+		k.reset_counter(2) if opts[:reset2]
+		k.write_all_digital(opts[:digital]) if opts[:digital]
+		k.set_analog(1, opts[:analog1]) if opts[:analog1]
+		k.set_analog(2, opts[:analog2]) if opts[:analog2]
+		k.set_debounce(1, opts[:debounce1]) if opts[:debounce1]
+		k.set_debounce(2, opts[:debounce2]) if opts[:debounce2]
+		k
+	end
+
+	if opts[:count] > 0
+		logs = boards.zip(opts[:boards]).map do |k, address|
+			BoardLog.new(k, address, opts[:count], opts[:delay] * 1000)
+		end
+		merge(logs, out, opts[:format])
+	end
+	out.close unless out == $stdout
+
+	boards.each(&:disconnect)
+	failed = (logs || []).select(&:error)
+	abort failed.map { |log| "board #{log.address}: #{log.error.message}" }.join("\n") unless failed.empty?
 end
 
 main(ARGV)
-
@@ -0,0 +1,18 @@
+# Prints the input packets in a capture file written by RubyK8055#start_capture,
+# oldest first, one line per packet:
+#
+#   ruby k8055_dump.rb capture.k8055
+#
+# time (s, CLOCK_MONOTONIC);dinp1-5;ainp1-2;ctr1-2
+# The packets are decoded by the library itself, with the same bit unpacking
+# as ReadAllDigital.
+
+require 'rubyk8055'
+
+path = ARGV[0] or abort "usage: #{$0} capture-file"
+
+samples = USB::RubyK8055.read_capture(path)
+samples.each do |s|
+  puts format("%.6f;%s", s.timestamp, s.to_a[0, 9].join(";"))
+end
+$stderr.puts "#{samples.size} packets" if $stderr.tty?
@@ -0,0 +1,168 @@
+/*
+   Linux hidraw transport for libk8055.
+
+   Talks to the board through /dev/hidrawN with plain read(), write() and
+   poll(). The kernel's HID driver stays bound: it keeps polling the input
+   endpoint and queues every input report on each open hidraw file, so
+   nothing is detached and no libusb is needed. Like the libusb-1.0
+   transport, a read takes the newest report that arrived since the previous
+   read, or waits for the next one; the older ones are counted as skipped.
+
+   The K8055 has no numbered reports, so reports read carry the 8 data bytes
+   only, and writes are prefixed with report number 0.
+*/
+
+#ifdef HAVE_LINUX_HIDRAW_H
+
+#include "k8055_transport.h"
+#include <linux/hidraw.h>
+#include <linux/input.h>
+#include <sys/ioctl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <poll.h>
+
+typedef struct
+{
+    int fd;
+    unsigned long skipped;      /* drained before being read, see HidrawSkipped() */
+} hidraw_board;
+
+/* Open the entry name of /dev if it is the K8055 with this address, else -1 */
+static int OpenIfBoard(int dev_fd, const char *name, long board_address)
+{
+    struct hidraw_devinfo info;
+    int fd;
+
+    fd = openat(dev_fd, name, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    if (ioctl(fd, HIDIOCGRAWINFO, &info) < 0 || info.bustype != BUS_USB ||
+        (unsigned short)info.vendor != VELLEMAN_VENDOR_ID ||
+        (unsigned short)info.product != K8055_IPID + board_address)
+    {
+        close(fd);
+        return -1;
+    }
+    if (DEBUG)
+        fprintf(stderr, "Velleman Device Found @ Address %d (/dev/%s)\n", (int)board_address, name);
+    return fd;
+}
+
+static void *HidrawOpen(long board_address)
+{
+    hidraw_board *b;
+    struct dirent *entry;
+    DIR *dir = opendir("/dev");
+    int fd = -1;
+
+    if (dir == NULL)
+        return NULL;
+    while (fd < 0 && (entry = readdir(dir)) != NULL)
+        if (strncmp(entry->d_name, "hidraw", 6) == 0)
+            fd = OpenIfBoard(dirfd(dir), entry->d_name, board_address);
+    closedir(dir);
+    if (fd < 0)
+        return NULL;
+    b = calloc(1, sizeof(hidraw_board));
+    if (b == NULL)
+    {
+        close(fd);
+        return NULL;
+    }
+    b->fd = fd;
+    return b;
+}
+
+/* Drain the reports the kernel queued, keeping the last; if there were
+   none, wait up to timeout ms for the next one */
+static int HidrawRead(void *handle, unsigned char *packet, int len, int timeout)
+{
+    hidraw_board *b = handle;
+    unsigned char report[PACKET_LEN];
+    struct pollfd pfd;
+    int got = 0, rval;
+
+    for (;;)
+    {
+        rval = read(b->fd, report, sizeof(report));
+        if (rval > 0)
+        {
+            if (got > 0)
+                b->skipped++;
+            got = rval < len ? rval : len;
+            memcpy(packet, report, got);
+            continue;
+        }
+        if (rval < 0 && errno == EINTR)
+            continue;
+        if (rval == 0 || errno != EAGAIN)
+            return rval == 0 ? -EIO : -errno;
+        if (got > 0)
+            return got;
+        pfd.fd = b->fd;
+        pfd.events = POLLIN;
+        rval = poll(&pfd, 1, timeout);
+        if (rval == 0)
+            return -ETIMEDOUT;
+        if (rval < 0 && errno != EINTR)
+            return -errno;
+        if (rval > 0 && !(pfd.revents & POLLIN))
+            return -ENODEV;     /* POLLHUP/POLLERR: unplugged */
+    }
+}
+
+/* write() blocks until the kernel has sent the output report, under the
+   HID driver's own timeout rather than ours */
+static int HidrawWrite(void *handle, unsigned char *packet, int len, int timeout)
+{
+    hidraw_board *b = handle;
+    unsigned char report[PACKET_LEN + 1];
+    int rval;
+
+    if (len > PACKET_LEN)
+        len = PACKET_LEN;
+    report[0] = 0;
+    memcpy(report + 1, packet, len);
+    do
+        rval = write(b->fd, report, len + 1);
+    while (rval < 0 && errno == EINTR);
+    if (rval < 0)
+        return errno == EAGAIN ? -ETIMEDOUT : -errno;
+    return rval > 0 ? rval - 1 : 0;
+}
+
+/* called right after HidrawRead(), under the same lock */
+static unsigned long HidrawSkipped(void *handle)
+{
+    hidraw_board *b = handle;
+    unsigned long skipped = b->skipped;
+
+    b->skipped = 0;
+    return skipped;
+}
+
+static void HidrawClose(void *handle)
+{
+    hidraw_board *b = handle;
+
+    close(b->fd);
+    free(b);
+}
+
+const k8055_transport hidraw_transport =
+{
+    "hidraw",
+    HidrawOpen,
+    HidrawRead,
+    HidrawWrite,
+    HidrawClose,
+    HidrawSkipped
+};
+
+#endif /* HAVE_LINUX_HIDRAW_H */
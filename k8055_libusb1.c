@@ -0,0 +1,356 @@
+/*
+   libusb-1.0 transport for libk8055.
+
+   Instead of a synchronous usb_interrupt_read() per call, every open board
+   keeps IN_FLIGHT interrupt IN transfers queued on the input endpoint, so the
+   host controller polls it at the endpoint's full interval. Completions are
+   handled on one event thread shared by all boards and land in a per-board
+   mailbox; a read takes the newest packet that arrived since the previous
+   read, or waits for the next one. Packets replaced before a read took them
+   are counted, see the transport's skipped(). An input endpoint that keeps
+   failing is given up on after IN_ERROR_LIMIT errors in a row, rather than
+   resubmitted forever on the shared event thread, and reads then fail.
+   OUT packets are submitted asynchronously on the same engine and the
+   writer waits for their completion callback.
+*/
+
+#ifdef HAVE_LIBUSB_H
+
+#include "k8055_transport.h"
+#include <libusb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define IN_FLIGHT 4             /* IN transfers kept queued per board */
+#define EVENT_TIMEOUT 100000    /* us, how long the event thread blocks in libusb */
+#define IN_ERROR_LIMIT 16       /* failed IN transfers in a row before giving up */
+
+typedef struct
+{
+    libusb_device_handle *handle;
+    struct libusb_transfer *in[IN_FLIGHT];
+    unsigned char in_buf[IN_FLIGHT][PACKET_LEN];
+    struct libusb_transfer *out;
+    unsigned char out_buf[PACKET_LEN];
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    /* newest complete input packet and how many have arrived/been read */
+    unsigned char latest[PACKET_LEN];
+    unsigned long received, consumed;
+    unsigned long skipped;      /* replaced before being read, see Usb1Skipped() */
+    int in_errors;              /* failed IN transfers in a row */
+    int in_failed;              /* gave up on the input endpoint */
+
+    int out_done, out_status, out_length;
+    int active;     /* transfers currently owned by libusb */
+    int closing;
+    int gone;       /* device was unplugged */
+} usb1_board;
+
+/* the event engine, shared by every board opened through this transport */
+static pthread_mutex_t engine_lock = PTHREAD_MUTEX_INITIALIZER;
+static libusb_context *ctx;
+static pthread_t event_thread;
+static atomic_int engine_running;
+static int engine_users;
+
+static void *EventThread(void *arg)
+{
+    struct timeval tv;
+
+    while (atomic_load(&engine_running))
+    {
+        tv.tv_sec = 0;
+        tv.tv_usec = EVENT_TIMEOUT;
+        libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+    }
+    return NULL;
+}
+
+static int EngineStart(void)
+{
+    int rval = 0;
+
+    pthread_mutex_lock(&engine_lock);
+    if (engine_users == 0)
+    {
+        if (libusb_init(&ctx) < 0)
+            rval = -1;
+        else
+        {
+            atomic_store(&engine_running, 1);
+            if (pthread_create(&event_thread, NULL, EventThread, NULL) != 0)
+            {
+                atomic_store(&engine_running, 0);
+                libusb_exit(ctx);
+                ctx = NULL;
+                rval = -1;
+            }
+        }
+    }
+    if (rval == 0)
+        engine_users++;
+    pthread_mutex_unlock(&engine_lock);
+    return rval;
+}
+
+static void EngineStop(void)
+{
+    pthread_mutex_lock(&engine_lock);
+    if (--engine_users == 0)
+    {
+        atomic_store(&engine_running, 0);
+        pthread_join(event_thread, NULL);
+        libusb_exit(ctx);
+        ctx = NULL;
+    }
+    pthread_mutex_unlock(&engine_lock);
+}
+
+static void Deadline(struct timespec *deadline, int timeout)
+{
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += timeout / 1000;
+    deadline->tv_nsec += (timeout % 1000) * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L)
+    {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+/* runs on the event thread */
+static void InputDone(struct libusb_transfer *transfer)
+{
+    usb1_board *b = transfer->user_data;
+
+    pthread_mutex_lock(&b->lock);
+    if (transfer->status == LIBUSB_TRANSFER_COMPLETED &&
+        transfer->actual_length == PACKET_LEN)
+    {
+        if (b->received != b->consumed)
+            b->skipped++;
+        memcpy(b->latest, transfer->buffer, PACKET_LEN);
+        b->received++;
+        b->in_errors = 0;
+    }
+    else if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE)
+        b->gone = 1;
+    else if (transfer->status != LIBUSB_TRANSFER_CANCELLED && ++b->in_errors >= IN_ERROR_LIMIT)
+    {
+        if (DEBUG && !b->in_failed)
+            fprintf(stderr, "Input endpoint keeps failing (transfer status %d)\n", (int)transfer->status);
+        b->in_failed = 1;
+    }
+
+    /* keep the endpoint busy until the board is closed or keeps failing */
+    if (b->closing || b->gone || b->in_failed || libusb_submit_transfer(transfer) < 0)
+        b->active--;
+    pthread_cond_broadcast(&b->cond);
+    pthread_mutex_unlock(&b->lock);
+}
+
+/* runs on the event thread */
+static void OutputDone(struct libusb_transfer *transfer)
+{
+    usb1_board *b = transfer->user_data;
+
+    pthread_mutex_lock(&b->lock);
+    b->out_status = transfer->status;
+    b->out_length = transfer->actual_length;
+    b->out_done = 1;
+    if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE)
+        b->gone = 1;
+    b->active--;
+    pthread_cond_broadcast(&b->cond);
+    pthread_mutex_unlock(&b->lock);
+}
+
+static void Usb1Close(void *handle);
+
+static void *Usb1Open(long board_address)
+{
+    pthread_condattr_t cattr;
+    usb1_board *b;
+    int i, rval;
+
+    if (EngineStart() < 0)
+        return NULL;
+    b = calloc(1, sizeof(usb1_board));
+    if (b == NULL)
+    {
+        EngineStop();
+        return NULL;
+    }
+    pthread_mutex_init(&b->lock, NULL);
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+    pthread_cond_init(&b->cond, &cattr);
+    pthread_condattr_destroy(&cattr);
+
+    b->handle = libusb_open_device_with_vid_pid(ctx, VELLEMAN_VENDOR_ID,
+                                                K8055_IPID + (int)board_address);
+    if (b->handle == NULL)
+    {
+        if (DEBUG)
+            fprintf(stderr, "Could not find velleman k8055 with address %d\n",
+                    (int)board_address);
+        Usb1Close(b);
+        return NULL;
+    }
+
+    /* the kernel HID driver gets the board back when we release it */
+    if (libusb_set_auto_detach_kernel_driver(b->handle, 1) < 0 &&
+        libusb_kernel_driver_active(b->handle, 0) == 1)
+        libusb_detach_kernel_driver(b->handle, 0);
+    rval = libusb_claim_interface(b->handle, 0);
+    if (rval < 0)
+    {
+        if (DEBUG)
+            fprintf(stderr, "Claim interface error: %s\n", libusb_error_name(rval));
+        Usb1Close(b);
+        return NULL;
+    }
+
+    b->out = libusb_alloc_transfer(0);
+    for (i = 0; i < IN_FLIGHT; i++)
+    {
+        b->in[i] = libusb_alloc_transfer(0);
+        if (b->in[i] == NULL)
+            continue;
+        libusb_fill_interrupt_transfer(b->in[i], b->handle, USB_INP_EP, b->in_buf[i],
+                                       PACKET_LEN, InputDone, b, 0);
+        pthread_mutex_lock(&b->lock);
+        if (libusb_submit_transfer(b->in[i]) == 0)
+            b->active++;
+        pthread_mutex_unlock(&b->lock);
+    }
+    if (b->out == NULL || b->active == 0)
+    {
+        Usb1Close(b);
+        return NULL;
+    }
+    if (DEBUG)
+        fprintf(stderr, "Velleman Device Found @ Address %d (libusb-1.0)\n", (int)board_address);
+    return b;
+}
+
+static int Usb1Read(void *handle, unsigned char *packet, int len, int timeout)
+{
+    usb1_board *b = handle;
+    struct timespec deadline;
+    int rval = 0;
+
+    Deadline(&deadline, timeout);
+    pthread_mutex_lock(&b->lock);
+    while (b->received == b->consumed && !b->gone && !b->in_failed && rval != ETIMEDOUT)
+        rval = pthread_cond_timedwait(&b->cond, &b->lock, &deadline);
+    if (b->received == b->consumed)
+    {
+        pthread_mutex_unlock(&b->lock);
+        return b->gone ? -ENODEV : b->in_failed ? -EIO : -ETIMEDOUT;
+    }
+    memcpy(packet, b->latest, len < PACKET_LEN ? len : PACKET_LEN);
+    b->consumed = b->received;
+    pthread_mutex_unlock(&b->lock);
+    return len < PACKET_LEN ? len : PACKET_LEN;
+}
+
+static int Usb1Write(void *handle, unsigned char *packet, int len, int timeout)
+{
+    usb1_board *b = handle;
+    int rval;
+
+    if (len > PACKET_LEN)
+        len = PACKET_LEN;
+    pthread_mutex_lock(&b->lock);
+    if (b->gone)
+    {
+        pthread_mutex_unlock(&b->lock);
+        return -ENODEV;
+    }
+    memcpy(b->out_buf, packet, len);
+    libusb_fill_interrupt_transfer(b->out, b->handle, USB_OUT_EP, b->out_buf, len,
+                                   OutputDone, b, timeout);
+    b->out_done = 0;
+    rval = libusb_submit_transfer(b->out);
+    if (rval < 0)
+    {
+        pthread_mutex_unlock(&b->lock);
+        return rval == LIBUSB_ERROR_NO_DEVICE ? -ENODEV : rval;
+    }
+    b->active++;
+    /* libusb enforces the timeout and always calls OutputDone */
+    while (!b->out_done)
+        pthread_cond_wait(&b->cond, &b->lock);
+    if (b->out_status == LIBUSB_TRANSFER_COMPLETED)
+        rval = b->out_length;
+    else if (b->out_status == LIBUSB_TRANSFER_TIMED_OUT)
+        rval = -ETIMEDOUT;
+    else
+        rval = (b->out_status == LIBUSB_TRANSFER_NO_DEVICE) ? -ENODEV : -EIO;
+    pthread_mutex_unlock(&b->lock);
+    return rval;
+}
+
+static unsigned long Usb1Skipped(void *handle)
+{
+    usb1_board *b = handle;
+    unsigned long skipped;
+
+    pthread_mutex_lock(&b->lock);
+    skipped = b->skipped;
+    b->skipped = 0;
+    pthread_mutex_unlock(&b->lock);
+    return skipped;
+}
+
+static void Usb1Close(void *handle)
+{
+    usb1_board *b = handle;
+    int i;
+
+    pthread_mutex_lock(&b->lock);
+    b->closing = 1;
+    for (i = 0; i < IN_FLIGHT; i++)
+        if (b->in[i] != NULL)
+            libusb_cancel_transfer(b->in[i]);
+    /* the callbacks of cancelled transfers still run on the event thread */
+    while (b->active > 0)
+        pthread_cond_wait(&b->cond, &b->lock);
+    pthread_mutex_unlock(&b->lock);
+
+    for (i = 0; i < IN_FLIGHT; i++)
+        if (b->in[i] != NULL)
+            libusb_free_transfer(b->in[i]);
+    if (b->out != NULL)
+        libusb_free_transfer(b->out);
+    if (b->handle != NULL)
+    {
+        libusb_release_interface(b->handle, 0);
+        libusb_close(b->handle);
+    }
+    pthread_cond_destroy(&b->cond);
+    pthread_mutex_destroy(&b->lock);
+    free(b);
+    EngineStop();
+}
+
+const k8055_transport libusb1_transport =
+{
+    "libusb1",
+    Usb1Open,
+    Usb1Read,
+    Usb1Write,
+    Usb1Close,
+    Usb1Skipped
+};
+
+#endif /* HAVE_LIBUSB_H */
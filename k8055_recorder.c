@@ -0,0 +1,219 @@
+/*
+   Flight recorder for libk8055.
+
+   Every input packet a board publishes can be appended to a capture file:
+   a header followed by a ring of fixed-size records, mapped into memory with
+   MAP_SHARED. Appending is a handful of stores into the mapping, so capture
+   can run permanently at the full poll rate; the kernel writes the pages
+   back on its own, and they survive the process crashing.
+
+   Crash safety comes from sequence numbers. A record's seq is zeroed before
+   its packet is written and set to its index + 1 afterwards, and the header's
+   head is bumped only once the record is complete, so a reader skips any
+   record that was torn or is being overwritten. Reopening a capture file of
+   the same size resumes after its newest record instead of wiping it.
+
+	+--------+---------+-------------+----------+------+
+	| magic  | version | record size | capacity | head |   header, 64 bytes
+	+--------+---------+-------------+----------+------+
+	| seq    | timestamp (ns)        | 8-byte packet   |   record 0
+	+--------+-----------------------+-----------------+
+	| ...                                              |   record capacity-1
+	+--------------------------------------------------+
+*/
+
+#include "k8055.h"
+#include "k8055_transport.h"
+#include "k8055_recorder.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define RECORDER_MAGIC "K8055REC"
+#define RECORDER_VERSION 1
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t capacity;          /* records in the ring */
+    _Atomic uint64_t head;      /* records ever written, the next goes to head % capacity */
+    unsigned char reserved[32];
+} recorder_header;
+
+typedef struct
+{
+    _Atomic uint64_t seq;       /* index + 1 once complete, 0 while being written */
+    uint64_t timestamp;         /* CLOCK_MONOTONIC, nanoseconds */
+    unsigned char packet[8];
+} recorder_record;
+
+struct k8055_recorder
+{
+    size_t size;
+    recorder_header *header;
+    recorder_record *records;
+    uint64_t head;              /* local copy, only the writer moves it */
+};
+
+struct k8055_recording
+{
+    size_t size;
+    recorder_header *header;
+    recorder_record *records;
+    uint64_t next, end;         /* records still to be returned */
+};
+
+static size_t RecorderSize(uint64_t capacity)
+{
+    return sizeof(recorder_header) + capacity * sizeof(recorder_record);
+}
+
+static int ValidHeader(const recorder_header *header, size_t size)
+{
+    return memcmp(header->magic, RECORDER_MAGIC, 8) == 0 &&
+        header->version == RECORDER_VERSION &&
+        header->record_size == sizeof(recorder_record) &&
+        header->capacity > 0 &&
+        RecorderSize(header->capacity) == size;
+}
+
+k8055_recorder *RecorderOpen(const char *path, unsigned long records)
+{
+    k8055_recorder *rec;
+    struct stat st;
+    size_t size = RecorderSize(records);
+    void *map;
+    int fd;
+
+    if (records == 0)
+        return NULL;
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0 || ((size_t)st.st_size != size && ftruncate(fd, size) < 0))
+    {
+        close(fd);
+        return NULL;
+    }
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+    rec = calloc(1, sizeof(k8055_recorder));
+    if (rec == NULL)
+    {
+        munmap(map, size);
+        return NULL;
+    }
+    rec->size = size;
+    rec->header = map;
+    rec->records = (recorder_record *)(rec->header + 1);
+
+    if (ValidHeader(rec->header, size))
+        rec->head = atomic_load(&rec->header->head);
+    else
+    {
+        memset(map, 0, size);
+        memcpy(rec->header->magic, RECORDER_MAGIC, 8);
+        rec->header->version = RECORDER_VERSION;
+        rec->header->record_size = sizeof(recorder_record);
+        rec->header->capacity = records;
+        rec->head = 0;
+    }
+    if (DEBUG)
+        fprintf(stderr, "Capturing input packets to %s (%lu records)\n", path, records);
+    return rec;
+}
+
+void RecorderAppend(k8055_recorder *rec, const unsigned char *packet, uint64_t timestamp)
+{
+    recorder_record *r = &rec->records[rec->head % rec->header->capacity];
+
+    atomic_store_explicit(&r->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    r->timestamp = timestamp;
+    memcpy(r->packet, packet, 8);
+    atomic_store_explicit(&r->seq, rec->head + 1, memory_order_release);
+    rec->head++;
+    atomic_store_explicit(&rec->header->head, rec->head, memory_order_release);
+}
+
+void RecorderClose(k8055_recorder *rec)
+{
+    if (rec == NULL)
+        return;
+    munmap(rec->header, rec->size);
+    free(rec);
+}
+
+/* Open a capture file for reading. The records present when it is opened
+   are returned oldest first by NextRecordedSample(). */
+k8055_recording *OpenRecording(const char *path)
+{
+    k8055_recording *r;
+    struct stat st;
+    void *map;
+    uint64_t head, capacity;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(recorder_header))
+    {
+        close(fd);
+        return NULL;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+    if (!ValidHeader(map, st.st_size) || (r = calloc(1, sizeof(k8055_recording))) == NULL)
+    {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    r->size = st.st_size;
+    r->header = map;
+    r->records = (recorder_record *)(r->header + 1);
+    head = atomic_load_explicit(&r->header->head, memory_order_acquire);
+    capacity = r->header->capacity;
+    r->next = head > capacity ? head - capacity : 0;
+    r->end = head;
+    return r;
+}
+
+/* Copy the next complete record into sample. Returns 1, or 0 when there are
+   no more. Records torn by a crash or overwritten since the file was opened
+   are skipped. */
+int NextRecordedSample(k8055_recording *r, k8055_sample *sample)
+{
+    const recorder_record *rec;
+    uint64_t seq;
+
+    while (r->next < r->end)
+    {
+        rec = &r->records[r->next % r->header->capacity];
+        seq = atomic_load_explicit(&rec->seq, memory_order_acquire);
+        sample->timestamp = rec->timestamp;
+        memcpy(sample->packet, rec->packet, 8);
+        sample->digital = DecodeDigital(rec->packet);    /* captures are raw */
+        atomic_thread_fence(memory_order_acquire);
+        r->next++;
+        if (seq == r->next && atomic_load_explicit(&rec->seq, memory_order_relaxed) == seq)
+            return 1;
+    }
+    return 0;
+}
+
+void CloseRecording(k8055_recording *r)
+{
+    if (r == NULL)
+        return;
+    munmap(r->header, r->size);
+    free(r);
+}
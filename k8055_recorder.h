@@ -0,0 +1,21 @@
+/*
+   Flight recorder used by StartCapture(): a fixed-size ring of input
+   packets in a memory-mapped file, see k8055_recorder.c.
+
+   This header is private to the library, it is not installed with k8055.h.
+*/
+
+#ifndef K8055_RECORDER_H
+#define K8055_RECORDER_H
+
+#include <stdint.h>
+
+typedef struct k8055_recorder k8055_recorder;
+
+/* create (or resume) a capture file holding the last `records` packets */
+k8055_recorder *RecorderOpen(const char *path, unsigned long records);
+/* store one packet; plain memory stores, no system call */
+void RecorderAppend(k8055_recorder *rec, const unsigned char *packet, uint64_t timestamp);
+void RecorderClose(k8055_recorder *rec);
+
+#endif
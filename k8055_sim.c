@@ -0,0 +1,286 @@
+/*
+   Simulated K8055 transport for libk8055.
+
+   Speaks the same 8-byte packets as the real board (see the header of
+   libk8055.c) without any USB hardware, so the library, the Ruby wrapper
+   and the benchmarks can run on machines with no board attached. Each
+   transfer can be given a latency, random jitter and a failure rate; a
+   failed transfer behaves like a USB timeout.
+
+   Select it with OpenDeviceWith(k, address, "sim") or K8055_TRANSPORT=sim.
+   K8055_SIM_LATENCY_US, K8055_SIM_JITTER_US and K8055_SIM_FAILURE_RATE set
+   the initial timing of every simulated board.
+*/
+
+#include "k8055_transport.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+struct k8055_sim
+{
+    long board_address;
+    pthread_mutex_t lock;
+
+    /* timing and failure injection */
+    long latency_us;
+    long jitter_us;
+    double failure_rate;
+    unsigned int seed;
+    int gone;                   /* unplugged by SimUnplug() */
+
+    /* inputs, digital as decoded by ReadAllDigital (input 1 = bit 0) */
+    long digital;
+    long analog1, analog2;
+    unsigned short counter1, counter2;
+
+    /* outputs, as last set by command 5 */
+    unsigned char digital_out;
+    unsigned char analog1_out, analog2_out;
+    unsigned char debounce1, debounce2;
+};
+
+/* like the real boards, each address can only be opened once, and an
+   unplugged board can't be opened until it is back */
+static pthread_mutex_t sim_lock = PTHREAD_MUTEX_INITIALIZER;
+static int sim_open[4];
+static struct timespec sim_back[4];
+
+static long EnvLong(const char *name, long fallback)
+{
+    const char *value = getenv(name);
+    return value != NULL ? atol(value) : fallback;
+}
+
+static void SleepMicroseconds(long us)
+{
+    struct timespec ts;
+
+    if (us <= 0)
+        return;
+    ts.tv_sec = us / 1000000;
+    ts.tv_nsec = (us % 1000000) * 1000;
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+        ;
+}
+
+/* Wait out one transfer's latency. Returns 0, or -ETIMEDOUT (after waiting
+   the full timeout) when failure injection decides this transfer is lost. */
+static int Transfer(k8055_sim *sim, int timeout)
+{
+    long latency;
+    int failed;
+
+    pthread_mutex_lock(&sim->lock);
+    if (sim->gone)
+    {
+        pthread_mutex_unlock(&sim->lock);
+        return -ENODEV;
+    }
+    latency = sim->latency_us;
+    if (sim->jitter_us > 0)
+        latency += rand_r(&sim->seed) % (sim->jitter_us + 1);
+    failed = rand_r(&sim->seed) / (RAND_MAX + 1.0) < sim->failure_rate;
+    pthread_mutex_unlock(&sim->lock);
+
+    if (failed)
+    {
+        SleepMicroseconds(timeout * 1000L);
+        return -ETIMEDOUT;
+    }
+    SleepMicroseconds(latency);
+    return 0;
+}
+
+static void *SimOpen(long board_address)
+{
+    k8055_sim *sim;
+
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&sim_lock);
+    if (now.tv_sec < sim_back[board_address].tv_sec ||
+        (now.tv_sec == sim_back[board_address].tv_sec &&
+         now.tv_nsec < sim_back[board_address].tv_nsec))
+    {
+        pthread_mutex_unlock(&sim_lock);
+        return NULL;
+    }
+    if (sim_open[board_address])
+    {
+        pthread_mutex_unlock(&sim_lock);
+        if (DEBUG)
+            fprintf(stderr, "Simulated k8055 with address %d is already open\n",
+                    (int)board_address);
+        return NULL;
+    }
+    sim = calloc(1, sizeof(k8055_sim));
+    if (sim == NULL)
+    {
+        pthread_mutex_unlock(&sim_lock);
+        return NULL;
+    }
+    sim_open[board_address] = 1;
+    pthread_mutex_unlock(&sim_lock);
+
+    pthread_mutex_init(&sim->lock, NULL);
+    sim->board_address = board_address;
+    sim->latency_us = EnvLong("K8055_SIM_LATENCY_US", 0);
+    sim->jitter_us = EnvLong("K8055_SIM_JITTER_US", 0);
+    sim->failure_rate = getenv("K8055_SIM_FAILURE_RATE") ? atof(getenv("K8055_SIM_FAILURE_RATE")) : 0.0;
+    sim->seed = (unsigned int)time(NULL) ^ (unsigned int)board_address;
+    if (DEBUG)
+        fprintf(stderr, "Simulated Velleman Device @ Address %d\n", (int)board_address);
+    return sim;
+}
+
+static int SimRead(void *handle, unsigned char *packet, int len, int timeout)
+{
+    k8055_sim *sim = handle;
+    unsigned char data[PACKET_LEN];
+    int rval = Transfer(sim, timeout);
+
+    if (rval < 0)
+        return rval;
+    pthread_mutex_lock(&sim->lock);
+    data[0] = ((sim->digital & 0x03) << 4) |    /* Input 1 and 2 */
+              ((sim->digital & 0x04) >> 2) |    /* Input 3 */
+              ((sim->digital & 0x18) << 3);     /* Input 4 and 5 */
+    data[1] = 0x01 | (sim->board_address << 1); /* status OK */
+    data[2] = (unsigned char)sim->analog1;
+    data[3] = (unsigned char)sim->analog2;
+    data[4] = sim->counter1 & 0xff;
+    data[5] = sim->counter1 >> 8;
+    data[6] = sim->counter2 & 0xff;
+    data[7] = sim->counter2 >> 8;
+    pthread_mutex_unlock(&sim->lock);
+
+    if (len > PACKET_LEN)
+        len = PACKET_LEN;
+    memcpy(packet, data, len);
+    return len;
+}
+
+static int SimWrite(void *handle, unsigned char *packet, int len, int timeout)
+{
+    k8055_sim *sim = handle;
+    int rval = Transfer(sim, timeout);
+
+    if (rval < 0)
+        return rval;
+    if (len < PACKET_LEN)
+        return len;
+
+    pthread_mutex_lock(&sim->lock);
+    switch (packet[0])
+    {
+    case 0x00:  /* reset */
+        sim->digital_out = sim->analog1_out = sim->analog2_out = 0;
+        break;
+    case 0x01:  /* debounce counter 1 */
+        sim->debounce1 = packet[6];
+        break;
+    case 0x02:  /* debounce counter 2 */
+        sim->debounce2 = packet[7];
+        break;
+    case 0x03:  /* reset counter 1 */
+        sim->counter1 = 0;
+        break;
+    case 0x04:  /* reset counter 2 */
+        sim->counter2 = 0;
+        break;
+    case 0x05:  /* set analog/digital */
+        sim->digital_out = packet[1];
+        sim->analog1_out = packet[2];
+        sim->analog2_out = packet[3];
+        break;
+    }
+    pthread_mutex_unlock(&sim->lock);
+    return PACKET_LEN;
+}
+
+static void SimClose(void *handle)
+{
+    k8055_sim *sim = handle;
+
+    pthread_mutex_lock(&sim_lock);
+    sim_open[sim->board_address] = 0;
+    pthread_mutex_unlock(&sim_lock);
+    pthread_mutex_destroy(&sim->lock);
+    free(sim);
+}
+
+void SimConfigure(k8055_sim *sim, long latency_us, long jitter_us, double failure_rate)
+{
+    pthread_mutex_lock(&sim->lock);
+    sim->latency_us = latency_us > 0 ? latency_us : 0;
+    sim->jitter_us = jitter_us > 0 ? jitter_us : 0;
+    sim->failure_rate = failure_rate;
+    pthread_mutex_unlock(&sim->lock);
+}
+
+void SimSetInputs(k8055_sim *sim, long digital, long analog1, long analog2)
+{
+    pthread_mutex_lock(&sim->lock);
+    sim->digital = digital & 0x1f;
+    sim->analog1 = analog1 & 0xff;
+    sim->analog2 = analog2 & 0xff;
+    pthread_mutex_unlock(&sim->lock);
+}
+
+/* counters are 16 bits on the board and wrap the same way */
+void SimPulseCounter(k8055_sim *sim, long counterno, long pulses)
+{
+    pthread_mutex_lock(&sim->lock);
+    if (counterno == 2)
+        sim->counter2 += (unsigned short)pulses;
+    else
+        sim->counter1 += (unsigned short)pulses;
+    pthread_mutex_unlock(&sim->lock);
+}
+
+/* Drop the board off the bus: its transfers fail with -ENODEV, and it can be
+   opened again after ms milliseconds, with its outputs off like a board that
+   was power cycled */
+void SimUnplug(k8055_sim *sim, long ms)
+{
+    struct timespec back;
+
+    clock_gettime(CLOCK_MONOTONIC, &back);
+    back.tv_sec += ms / 1000;
+    back.tv_nsec += (ms % 1000) * 1000000L;
+    if (back.tv_nsec >= 1000000000L)
+    {
+        back.tv_sec++;
+        back.tv_nsec -= 1000000000L;
+    }
+    pthread_mutex_lock(&sim->lock);
+    sim->gone = 1;
+    pthread_mutex_unlock(&sim->lock);
+    pthread_mutex_lock(&sim_lock);
+    sim_back[sim->board_address] = back;
+    pthread_mutex_unlock(&sim_lock);
+}
+
+void SimGetOutputs(k8055_sim *sim, long *digital, long *analog1, long *analog2)
+{
+    pthread_mutex_lock(&sim->lock);
+    *digital = sim->digital_out;
+    *analog1 = sim->analog1_out;
+    *analog2 = sim->analog2_out;
+    pthread_mutex_unlock(&sim->lock);
+}
+
+const k8055_transport sim_transport =
+{
+    "sim",
+    SimOpen,
+    SimRead,
+    SimWrite,
+    SimClose,
+    NULL
+};
@@ -3,15 +3,21 @@
 # Sinatra http client for K8055 Interface board. Requires 'rubyk8055' and 'sinatra'.
 require 'rubygems'
 require 'sinatra'
+require 'json'
 require 'rubyk8055'
 
 configure do
   # Initialize the rubyk8055 class and clear all outputs.
   $k8055 = USB::RubyK8055.new
   $k8055.connect
-  $k8055.clear_all_digital
-  $k8055.clear_all_analog
-  $out_arr = [0]*10   # outputs (8x digital, 2x analog)
+  # Page and /data hits within this many seconds of a board read share it,
+  # and requests that arrive during a read wait for it instead of queueing
+  # reads of their own. K8055_MAX_AGE=0 reads the board on every request.
+  $k8055.read_cache_age = (ENV['K8055_MAX_AGE'] || 0.1).to_f
+  $k8055.batch do |b|
+    b.clear_all_digital
+    b.clear_all_analog
+  end
 end
 
 def _layout(msg="")
@@ -37,15 +43,15 @@ def _layout(msg="")
         <tbody>
           <tr>
             <td> <b>all inputs</b> :: </td>
-            <td> #{data} </td>
+            <td id="inputs"> #{data} </td>
           </tr>
           <tr>
             <td> <b>digital outputs</b> :: </td>
-            <td> [#{$out_arr[0,8].join(",")}] </td>
+            <td> [#{$k8055.digital_outputs.join(",")}] </td>
           <tr>
           </tr>
             <td> <b>analog outputs</b> :: </td>
-            <td> [#{$out_arr[8,10].join(",")}] </td>
+            <td> [#{$k8055.analog_outputs.join(",")}] </td>
           </tr>
         </tbody>
       </table>
@@ -61,9 +67,9 @@ def _layout(msg="")
       <form action="/set/analog" method="post">
         <P>
         <LABEL for="value_1">Channel 1 value:</LABEL>
-        <INPUT type="text" name="value_1" value=#{$out_arr[8]}><BR>
+        <INPUT type="text" name="value_1" value=#{$k8055.analog_outputs[0]}><BR>
         <LABEL for="value_2">Channel 2 value:</LABEL>
-        <INPUT type="text" name="value_2" value=#{$out_arr[9]}><BR>
+        <INPUT type="text" name="value_2" value=#{$k8055.analog_outputs[1]}><BR>
         <INPUT type="submit" value="Set Analog Inputs">
         </P>
      </form>
@@ -76,6 +82,18 @@ def _layout(msg="")
 
       <BR><BR>
       <h3>~~msg~~</h3>
+      <script>
+        // follow /stream instead of reloading the page for input changes
+        if (window.EventSource) {
+          var inputs = "#{data}".split(";");
+          var names = #{STREAM_KEYS.to_json};
+          new EventSource("/stream?rate=20").onmessage = function(e) {
+            var delta = JSON.parse(e.data);
+            for (var k in delta) inputs[names.indexOf(k)] = delta[k];
+            document.getElementById("inputs").textContent = inputs.join(";");
+          };
+        }
+      </script>
     </body>
   </html>
   }.gsub("~~msg~~", msg)
@@ -92,80 +110,159 @@ get '/data' do
   $k8055.to_s
 end
 
+# USB transfer counters and latency histograms in Prometheus text format
+get '/metrics' do
+  content_type 'text/plain; version=0.0.4'
+  board = %Q{board="#{$k8055.board_address}"}
+  stats = $k8055.stats
+  out = []
+  # every count in stats is a counter series; :time and :histogram make up
+  # the latency histogram below
+  counters = stats.values.flat_map(&:keys).uniq - [:time, :histogram]
+  counters.each do |counter|
+    out << "# TYPE k8055_#{counter}_total counter"
+    stats.each do |dir, s|
+      out << %Q{k8055_#{counter}_total{#{board},direction="#{dir}"} #{s[counter]}} if s.key?(counter)
+    end
+  end
+  out << "# TYPE k8055_transfer_seconds histogram"
+  stats.each do |dir, s|
+    cumulative = 0
+    USB::RubyK8055::LATENCY_BUCKETS.zip(s[:histogram]).each do |le, n|
+      cumulative += n
+      le = le.infinite? ? "+Inf" : le.to_s
+      out << %Q{k8055_transfer_seconds_bucket{#{board},direction="#{dir}",le="#{le}"} #{cumulative}}
+    end
+    out << %Q{k8055_transfer_seconds_sum{#{board},direction="#{dir}"} #{s[:time]}}
+    out << %Q{k8055_transfer_seconds_count{#{board},direction="#{dir}"} #{s[:transfers]}}
+  end
+  out << "# TYPE k8055_write_errors_total counter"
+  out << %Q{k8055_write_errors_total{#{board}} #{$k8055.write_errors}}
+  out.join("\n") + "\n"
+end
+
+# ------------------------- live input stream -------------------------
+
+# Keys of the /stream updates, in all_inputs order.
+STREAM_KEYS = %w(d1 d2 d3 d4 d5 a1 a2 c1 c2)
+
+$stream_clients = []
+$stream_lock = Mutex.new
+
+# The single producer: waits on the acquisition thread for each new packet
+# and hands the inputs that changed to every subscriber's queue, so any
+# number of clients cost no extra board reads.
+def _stream_producer
+  $stream_lock.synchronize do
+    return if $stream_thread && $stream_thread.alive?
+    $k8055.start_acquisition
+    $stream_thread = Thread.new do
+      last = [nil] * STREAM_KEYS.size
+      time = nil
+      loop do
+        s = $k8055.snapshot(time) or next
+        time = s.timestamp
+        values = s.to_a[0, STREAM_KEYS.size]
+        delta = {}
+        values.each_with_index { |v, i| delta[STREAM_KEYS[i]] = v if v != last[i] }
+        last = values
+        next if delta.empty?
+        $stream_lock.synchronize { $stream_clients.each { |q| q << delta } }
+      end
+    end
+  end
+end
+
+# Server-Sent Events. The first message holds every input, later ones only
+# the inputs that changed, e.g. data: {"d1":1,"a2":130}. ?rate=N limits a
+# client to N messages per second; changes made in between are merged, the
+# newest value winning. Needs a threaded server such as puma.
+get '/stream' do
+  content_type 'text/event-stream'
+  cache_control :no_cache
+  interval = params[:rate].to_f > 0 ? 1.0 / params[:rate].to_f : 0
+  queue = Queue.new
+  _stream_producer
+  stream do |out|
+    $stream_lock.synchronize { $stream_clients << queue }
+    begin
+      sent = Hash[STREAM_KEYS.zip($k8055.all_inputs || [])]
+      out << "retry: 1000\ndata: #{sent.to_json}\n\n"
+      until out.closed?
+        delta = queue.pop(timeout: 15)
+        if delta.nil?
+          out << ": keepalive\n\n"
+          next
+        end
+        sleep interval
+        delta = delta.merge(queue.pop) until queue.empty?
+        delta = delta.reject { |k, v| sent[k] == v }
+        next if delta.empty?
+        sent.update(delta)
+        out << "data: #{delta.to_json}\n\n"
+      end
+    rescue IOError, Errno::EPIPE, Errno::ECONNRESET
+    ensure
+      $stream_lock.synchronize { $stream_clients.delete(queue) }
+    end
+  end
+end
+
 get '/clear_all' do |n|
-  $k8055.clear_all_digital
-  $k8055.clear_all_analog
-  $out_arr = [0]*10
+  $k8055.batch do |b|
+    b.clear_all_digital
+    b.clear_all_analog
+  end
   _layout "Cleared all digital and analog outputs."
 end
 
 get '/set/digital/:channel' do |channel|
   $k8055.set_digital channel.to_i, true
-  $out_arr[channel.to_i - 1] = 1
   _layout "Set digital output [#{channel}] to [on]"
 end
 
 get '/clear/digital/:channel' do |channel|
   $k8055.set_digital channel.to_i, false
-  $out_arr[channel.to_i - 1] = 0
   _layout "Set digital output [#{channel}] to [off]"
 end
 
 get '/set/analog/:channel/:value' do |channel, value|
   $k8055.set_analog channel.to_i, value.to_i
-  $out_arr[channel.to_i + 7] = value.to_i
   _layout "Set analog output [#{channel}] to [#{value}]"
 end
 
 post '/set/analog' do
-  $k8055.set_analog 1, params[:value_1].to_i
-  $k8055.set_analog 2, params[:value_2].to_i
-  $out_arr[8] = params[:value_1].to_i
-  $out_arr[9] = params[:value_2].to_i
+  $k8055.batch do |b|
+    b.set_analog 1, params[:value_1].to_i
+    b.set_analog 2, params[:value_2].to_i
+  end
   _layout "Set analog outputs to specified values."
 end
 
 get '/clear/analog/:channel' do |channel|
   $k8055.set_analog channel.to_i, 0
-  $out_arr[channel.to_i + 7] = 0
   _layout "Set analog output [#{channel}] to [0]"
 end
 
-get '/test' do
+# The test program as output frames: [digital, analog1, analog2, seconds]
+def test_frames(delay = 0.03)
+  frames = []
   2.times do
-    1.upto 10 do |i|
-      if i <= 8
-        $k8055.set_digital i, true
-        sleep 0.03
-        $k8055.set_digital i, false
-      else
-        $k8055.set_analog_max i - 8
-        sleep 0.03
-        $k8055.set_analog_min i - 8
-      end
-    end
+    8.times { |i| frames << [1 << i, 0, 0, delay] }
+    frames << [0, 255, 0, delay] << [0, 0, 255, delay]
   end
   2.times do
-    1.upto 10 do |i|
-      if i <= 8
-        $k8055.set_digital i, true
-        sleep 0.03
-      else
-        $k8055.set_analog_max i - 8
-        sleep 0.03
-      end
-    end
-    1.upto 10 do |i|
-      if i <= 8
-        $k8055.set_digital i, false
-        sleep 0.03
-      else
-        $k8055.set_analog_min i - 8
-        sleep 0.03
-      end
-    end
+    d = 0
+    8.times { |i| frames << [d |= 1 << i, 0, 0, delay] }
+    frames << [d, 255, 0, delay] << [d, 255, 255, delay]
+    8.times { |i| frames << [d &= ~(1 << i), 255, 255, delay] }
+    frames << [0, 0, 255, delay] << [0, 0, 0, delay]
   end
-  $out_arr = [0]*10
-  _layout "Ran: test program."
+  frames
 end
 
+# played by the board's native sequence player, the request returns at once
+get '/test' do
+  $k8055.play_sequence test_frames
+  _layout "Started: test program."
+end
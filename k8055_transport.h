@@ -0,0 +1,55 @@
+/*
+   Transports move raw 8-byte packets between libk8055 and a board.
+   libk8055 picks one per board in OpenDevice(); everything above
+   ReadK8055Data() and WriteK8055Data() is transport independent.
+
+   This header is private to the library, it is not installed with k8055.h.
+*/
+
+#ifndef K8055_TRANSPORT_H
+#define K8055_TRANSPORT_H
+
+#define PACKET_LEN 8
+
+#define K8055_IPID 0x5500
+#define VELLEMAN_VENDOR_ID 0x10cf
+
+#define USB_OUT_EP 0x01	/* USB output endpoint */
+#define USB_INP_EP 0x81 /* USB Input endpoint */
+
+typedef struct
+{
+    const char *name;
+    /* open board 0-3, returns the transport's handle or NULL */
+    void *(*open)(long board_address);
+    /* transfer one packet, return the number of bytes moved, -ETIMEDOUT
+       when the board did not answer in time, -ENODEV (or -EIO) when it is
+       gone from the bus, or another value < 0 */
+    int (*read)(void *handle, unsigned char *packet, int len, int timeout);
+    int (*write)(void *handle, unsigned char *packet, int len, int timeout);
+    void (*close)(void *handle);
+    /* transports that queue input packets and read the newest: how many
+       were replaced by a newer one before a read took them, since the last
+       call. NULL when every packet is read. */
+    unsigned long (*skipped)(void *handle);
+} k8055_transport;
+
+extern int DEBUG;
+
+#ifdef HAVE_LINUX_HIDRAW_H
+extern const k8055_transport hidraw_transport;     /* k8055_hidraw.c */
+#endif
+#ifdef HAVE_LIBUSB_H
+extern const k8055_transport libusb1_transport;    /* k8055_libusb1.c */
+#endif
+
+/* simulated board, k8055_sim.c. Only used when asked for by name. */
+typedef struct k8055_sim k8055_sim;
+extern const k8055_transport sim_transport;
+void SimConfigure(k8055_sim *sim, long latency_us, long jitter_us, double failure_rate);
+void SimSetInputs(k8055_sim *sim, long digital, long analog1, long analog2);
+void SimPulseCounter(k8055_sim *sim, long counterno, long pulses);
+void SimGetOutputs(k8055_sim *sim, long *digital, long *analog1, long *analog2);
+void SimUnplug(k8055_sim *sim, long ms);
+
+#endif
@@ -80,191 +80,1686 @@
 
 
 #include "k8055.h"
+#include "k8055_transport.h"
+#include "k8055_recorder.h"
+#ifdef HAVE_USB_H
+#include <usb.h>
+#endif
 #include <math.h>
+#include <time.h>
+#include <sched.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #define STR_BUFF 256
-#define PACKET_LEN 8
 
-#define K8055_IPID 0x5500
-#define VELLEMAN_VENDOR_ID 0x10cf
+#define USB_TIMEOUT 20
+#define K8055_ERROR -1
+
+#define FIRST_SAMPLE_TIMEOUT 100    /* ms to wait for the acquisition thread's first packet */
+#define EDGE_QUEUE_LEN 256          /* digital transitions queued for WaitEdges() */
+#define RECONNECT_MIN_DELAY 10000000ULL      /* ns before the second reopen attempt */
+#define RECONNECT_MAX_DELAY 1000000000ULL    /* ns, cap of the doubling backoff */
+#define RATE_RESOLUTION 100000000ULL    /* ns per counter rate history slot */
+#define RATE_SLOTS 600                  /* 60 s of counter rate history */
+#define SLEEP_SLICE 10000000ULL         /* ns, longest AcquireSamples() sleep between interrupt checks */
+
+#define DIGITAL_INP_OFFSET 0
+#define DIGITAL_OUT_OFFSET 1
+#define ANALOG_1_OFFSET 2
+#define ANALOG_2_OFFSET 3
+#define COUNTER_1_OFFSET 4
+#define COUNTER_2_OFFSET 6
+
+#define CMD_RESET 0x00
+#define CMD_SET_DEBOUNCE_1 0x01
+#define CMD_SET_DEBOUNCE_2 0x01
+#define CMD_RESET_COUNTER_1 0x03
+#define CMD_RESET_COUNTER_2 0x04
+#define CMD_SET_ANALOG_DIGITAL 0x05
+
+/* set debug to 0 to not print excess info */
+int DEBUG = 1;
+
+/* transfer counters for one direction, updated without locks */
+typedef struct
+{
+    atomic_ulong transfers, retries, timeouts, short_packets, errors, failures, skipped;
+    atomic_ullong time_ns;
+    atomic_ulong histogram[K8055_HIST_BUCKETS];
+} transfer_stats;
+
+static const unsigned long hist_bounds_us[K8055_HIST_BUCKETS - 1] = K8055_HIST_BOUNDS_US;
+
+/* 64-bit total of one 16-bit board counter, plus a history of it with one
+   slot per RATE_RESOLUTION for ReadCounterRate() */
+typedef struct
+{
+    int valid;                  /* last_raw holds a value from this connection */
+    int reset_pending;          /* rebase on the next packet: ResetCounter() was sent,
+                                   or the board was just opened */
+    unsigned last_raw;
+    uint64_t total;
+    int history_valid;
+    uint64_t last_slot;         /* newest slot number (time / RATE_RESOLUTION) */
+    uint64_t first_slot;
+    struct { uint64_t time, total; } history[RATE_SLOTS];
+} counter_track;
+
+/* Sliding window over one analog input, updated from every packet. The
+   window is kept as a ring plus a histogram of its values (they are only 8
+   bits), so each packet costs one pass over 256 bins and reading the
+   results is a copy. */
+typedef struct
+{
+    unsigned long window;       /* values kept, 0 when the filter is off */
+    double alpha;               /* weight of the newest value in the EMA */
+    unsigned char values[K8055_FILTER_MAX_WINDOW];
+    unsigned long head, count;
+    unsigned long sum, sum_sq;
+    unsigned long histogram[256];
+    k8055_analog_stats stats;
+} analog_filter;
+
+/* Software debounce of one digital input, see SetDigitalDebounce(). A
+   change of the raw input is only passed on once it has lasted min_samples
+   packets and min_time. */
+typedef struct
+{
+    unsigned long min_samples;
+    uint64_t min_time;          /* ns */
+    int pending;                /* the raw input differs from the debounced one */
+    unsigned long count;        /* packets it has differed for */
+    uint64_t since;             /* time of the first of them */
+} input_debounce;
+
+/* Per-board state. Every entry point takes one of these, so several boards
+   can be open from the same process without sharing buffers. */
+struct k8055_dev
+{
+    const k8055_transport *transport;
+    void *handle;               /* transport's handle, NULL when closed */
+    long board_address;
+
+    /* automatic reconnect, see SetAutoReconnect(). A lost board is still
+       open as far as callers are concerned, but has no handle. */
+    int auto_reconnect;
+    int lost;
+    uint64_t reconnect_at, reconnect_delay;
+    atomic_ulong reconnects;
+
+    /* buffers for datatransfer. data_out[1-3] is the output state the
+       caller asked for, see GetOutputs(). */
+    unsigned char data_in[PACKET_LEN+1], data_out[PACKET_LEN+1];
+
+    /* outputs the board is known to have, as of the last command 5 packet
+       that got through. A command 5 write that wouldn't change them is
+       skipped. Only valid while outputs_known is set. */
+    unsigned char outputs_sent[3];
+    int outputs_known;
+    atomic_ulong writes_skipped;
+
+    /* serialises USB transfers and data_in/data_out between the caller and
+       the acquisition thread. Recursive, since a write does a confirm read. */
+    pthread_mutex_t io_lock;
+    atomic_int io_waiters;
+
+    /* latest input packet, published by every successful read. Protected by
+       a seqlock: odd sample_seq means a write is in progress. */
+    atomic_uint sample_seq;
+    unsigned char sample_packet[PACKET_LEN];
+    uint64_t sample_time;
+    unsigned char sample_digital;
+    pthread_mutex_t sample_lock;
+    pthread_cond_t sample_cond;
+
+    /* digital edge events: while edge_watch is set, PublishSample() queues
+       every change of the digital inputs. Protected by sample_lock. */
+    atomic_int edge_watch;
+    int edge_cancel;
+    long edge_last;             /* digital inputs of the previous packet, -1 if none */
+    k8055_edge edge_queue[EDGE_QUEUE_LEN];
+    unsigned edge_head, edge_count;
+    unsigned long edges_dropped;
+    pthread_cond_t edge_cond;
+
+    /* sequence player, see PlaySequence(). seq_lock guards the rest. */
+    pthread_t seq_thread;
+    int seq_running;            /* seq_thread exists and has not been joined */
+    int seq_stop;
+    atomic_int seq_playing;
+    k8055_frame *seq_frames;
+    unsigned long seq_count;
+    int seq_loop;
+    long seq_seek;              /* frame to jump to, -1 for none */
+    atomic_ulong seq_position, seq_missed;
+    pthread_mutex_t seq_lock;
+    pthread_cond_t seq_cond;
+
+    /* counter totals and rates, updated from every packet. Protected by
+       sample_lock. */
+    counter_track counters[2];
+
+    /* digital input debounce, see SetDigitalDebounce(). Only touched with
+       io_lock held, like data_in. digital_filtered is -1 until the first
+       packet after OpenDevice(). */
+    input_debounce debounce[5];
+    long digital_filtered;
+    atomic_ulong glitches;
+
+    /* analog input filters, see SetAnalogFilter(). Protected by sample_lock. */
+    analog_filter filters[2];
+
+    /* input reads are served from the sample cache while the latest sample
+       is at most this old (ns), see SetReadCacheAge() */
+    atomic_ullong read_max_age;
+
+    /* background acquisition */
+    pthread_t acq_thread;
+    atomic_int acquiring;
+
+    /* set by InterruptDevice() to cut retries and waits short */
+    atomic_int interrupted;
+
+    /* output batching: while batch_depth > 0, command 5 writes only update
+       data_out and are sent as one packet by EndOutputBatch() */
+    int batch_depth;
+    int batch_dirty;
+
+    /* asynchronous output, see SetAsyncOutput(): while out_async is set,
+       command 5 writes only update data_out and bump out_staged, and
+       out_thread sends the latest data_out until out_written catches up.
+       out_async and out_sending (the writer is in WriteK8055Data) are
+       guarded by io_lock, the rest by out_lock. */
+    int out_async, out_sending;
+    pthread_t out_thread;
+    int out_running, out_stop;
+    unsigned long out_staged, out_written;
+    pthread_mutex_t out_lock;
+    pthread_cond_t out_cond;
+
+    /* K8055_WRITE_CONFIRM, _NO_CONFIRM or _DEFERRED. In the last two modes a
+       failed write is counted in write_errors (and reported through
+       write_error_cb) instead of being returned to the caller. */
+    int write_mode;
+    int confirm_pending;        /* a deferred write awaits the next read */
+    unsigned char pending_cmd;
+    atomic_ulong write_errors;
+    k8055_write_error_cb write_error_cb;
+    void *write_error_data;
+
+    /* flight recorder, see StartCapture(). Only touched with io_lock held. */
+    k8055_recorder *recorder;
+
+    /* instrumentation, see GetStats() */
+    transfer_stats read_stats, write_stats;
+};
+
+/* Unpack the five digital inputs from the first byte of an input packet
+   into bits 0-4 (input 1 = bit 0) */
+long DecodeDigital(const unsigned char *packet)
+{
+    return (
+        ((packet[0] >> 4) & 0x03) |  /* Input 1 and 2 */
+        ((packet[0] << 2) & 0x04) |  /* Input 3 */
+        ((packet[0] >> 3) & 0x18) ); /* Input 4 and 5 */
+}
+
+/* The counters are sent as unsigned 16-bit little-endian values */
+static unsigned DecodeCounter(const unsigned char *packet, int offset)
+{
+    return packet[offset] | (packet[offset + 1] << 8);
+}
+
+/* CLOCK_MONOTONIC in nanoseconds, the time base of every sample timestamp */
+static uint64_t MonotonicNow(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Callers announce themselves in io_waiters so the acquisition thread,
+   which otherwise re-takes the lock immediately, lets them in. */
+static void LockIO(k8055_dev *k)
+{
+    atomic_fetch_add(&k->io_waiters, 1);
+    pthread_mutex_lock(&k->io_lock);
+    atomic_fetch_sub(&k->io_waiters, 1);
+}
+
+static void UnlockIO(k8055_dev *k)
+{
+    pthread_mutex_unlock(&k->io_lock);
+}
+
+/* Queue one event per digital input that differs from the previous packet.
+   Called with sample_lock held. When the queue is full the oldest edge is
+   dropped. */
+static void QueueEdges(k8055_dev *k, long digital, uint64_t timestamp)
+{
+    long changed = k->edge_last < 0 ? 0 : (digital ^ k->edge_last);
+    k8055_edge *e;
+    int i;
+
+    k->edge_last = digital;
+    if (changed == 0)
+        return;
+    for (i = 0; i < 5; i++)
+    {
+        if (!(changed & (1 << i)))
+            continue;
+        if (k->edge_count == EDGE_QUEUE_LEN)
+        {
+            k->edge_head = (k->edge_head + 1) % EDGE_QUEUE_LEN;
+            k->edge_count--;
+            k->edges_dropped++;
+        }
+        e = &k->edge_queue[(k->edge_head + k->edge_count++) % EDGE_QUEUE_LEN];
+        e->timestamp = timestamp;
+        e->channel = i + 1;
+        e->rising = (digital >> i) & 1;
+    }
+    pthread_cond_broadcast(&k->edge_cond);
+}
+
+/* Fold a packet's 16-bit counter value into the 64-bit total: the board
+   counter only ever goes up, so any decrease is a wrap at 65536. Also
+   records the total in the rate history, filling slots that no packet fell
+   into with the previous value. Called with sample_lock held. */
+static void TrackCounter(counter_track *c, unsigned raw, uint64_t time)
+{
+    uint64_t slot = time / RATE_RESOLUTION, s;
+
+    if (c->reset_pending)
+    {
+        c->total = raw;
+        c->reset_pending = 0;
+        c->history_valid = 0;
+    }
+    else if (c->valid)
+        c->total += (raw - c->last_raw) & 0xffff;
+    /* else the first packet since a reconnect: keep counting from here */
+    c->last_raw = raw;
+    c->valid = 1;
+
+    if (!c->history_valid)
+    {
+        c->history_valid = 1;
+        c->first_slot = c->last_slot = slot;
+    }
+    else if (slot > c->last_slot)
+    {
+        s = slot - c->last_slot > RATE_SLOTS ? slot - RATE_SLOTS : c->last_slot + 1;
+        for (; s < slot; s++)
+            c->history[s % RATE_SLOTS] = c->history[c->last_slot % RATE_SLOTS];
+        c->last_slot = slot;
+    }
+    c->history[slot % RATE_SLOTS].time = time;
+    c->history[slot % RATE_SLOTS].total = c->total;
+}
+
+/* Add a packet's analog value to a filter's window, dropping the oldest once
+   it is full, and recompute its statistics. Called with sample_lock held. */
+static void FilterAnalog(analog_filter *f, unsigned char value)
+{
+    k8055_analog_stats *st = &f->stats;
+    unsigned long seen = 0, lower, upper;
+    unsigned char old;
+    double mean, var;
+    int v, median_lo = -1, median_hi = -1;
+
+    if (f->window == 0)
+        return;
+    if (f->count == f->window)
+    {
+        old = f->values[f->head];
+        f->sum -= old;
+        f->sum_sq -= old * old;
+        f->histogram[old]--;
+        f->count--;
+    }
+    f->values[f->head] = value;
+    f->head = (f->head + 1) % f->window;
+    f->count++;
+    f->sum += value;
+    f->sum_sq += value * value;
+    f->histogram[value]++;
+
+    st->smoothed = st->samples == 0 ? value : st->smoothed + f->alpha * (value - st->smoothed);
+    st->samples = f->count;
+    mean = (double)f->sum / f->count;
+    var = (double)f->sum_sq / f->count - mean * mean;
+    st->mean = mean;
+    st->stddev = var > 0 ? sqrt(var) : 0;
+
+    /* the two middle values (the same one for an odd count), min and max */
+    lower = (f->count + 1) / 2;
+    upper = f->count / 2 + 1;
+    st->min = -1;
+    for (v = 0; v < 256; v++)
+    {
+        if (f->histogram[v] == 0)
+            continue;
+        if (st->min < 0)
+            st->min = v;
+        st->max = v;
+        seen += f->histogram[v];
+        if (median_lo < 0 && seen >= lower)
+            median_lo = v;
+        if (median_hi < 0 && seen >= upper)
+            median_hi = v;
+    }
+    st->median = (median_lo + median_hi) / 2.0;
+}
+
+/* Run the raw digital inputs of a packet through each input's debounce and
+   return the debounced ones. A change that reverts before it is passed on
+   counts as a glitch. Called with io_lock held. */
+static long DebounceDigital(k8055_dev *k, long raw, uint64_t now)
+{
+    long filtered = k->digital_filtered;
+    input_debounce *d;
+    int i;
+
+    if (filtered < 0)
+        filtered = raw;
+    for (i = 0; i < 5; i++)
+    {
+        d = &k->debounce[i];
+        if (((raw ^ filtered) & (1 << i)) == 0)
+        {
+            if (d->pending)
+                atomic_fetch_add(&k->glitches, 1);
+            d->pending = 0;
+            continue;
+        }
+        if (!d->pending)
+        {
+            d->pending = 1;
+            d->count = 0;
+            d->since = now;
+        }
+        if (++d->count >= d->min_samples && now - d->since >= d->min_time)
+        {
+            filtered ^= 1 << i;
+            d->pending = 0;
+        }
+    }
+    k->digital_filtered = filtered;
+    return filtered;
+}
+
+/* Copy data_in into the sample cache. Only called with io_lock held, so
+   there is a single writer. */
+static void PublishSample(k8055_dev *k)
+{
+    unsigned seq = atomic_load_explicit(&k->sample_seq, memory_order_relaxed);
+    uint64_t now = MonotonicNow();
+    long digital = DebounceDigital(k, DecodeDigital(k->data_in), now);
+
+    atomic_store_explicit(&k->sample_seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    memcpy(k->sample_packet, k->data_in, PACKET_LEN);
+    k->sample_time = now;
+    k->sample_digital = digital;
+    atomic_store_explicit(&k->sample_seq, seq + 2, memory_order_release);
+    if (k->recorder != NULL)
+        RecorderAppend(k->recorder, k->data_in, k->sample_time);
+
+    pthread_mutex_lock(&k->sample_lock);
+    TrackCounter(&k->counters[0], DecodeCounter(k->data_in, COUNTER_1_OFFSET), k->sample_time);
+    TrackCounter(&k->counters[1], DecodeCounter(k->data_in, COUNTER_2_OFFSET), k->sample_time);
+    FilterAnalog(&k->filters[0], k->data_in[ANALOG_1_OFFSET]);
+    FilterAnalog(&k->filters[1], k->data_in[ANALOG_2_OFFSET]);
+    if (atomic_load(&k->edge_watch))
+        QueueEdges(k, digital, k->sample_time);
+    pthread_cond_broadcast(&k->sample_cond);
+    pthread_mutex_unlock(&k->sample_lock);
+}
+
+/* Lock-free copy of the latest published sample. Returns the sequence
+   number it was read at, 0 when nothing has been published yet. */
+static unsigned LoadSample(k8055_dev *k, k8055_sample *sample)
+{
+    unsigned seq1, seq2;
+
+    do
+    {
+        seq1 = atomic_load_explicit(&k->sample_seq, memory_order_acquire);
+        if (seq1 & 1)
+            continue;
+        memcpy(sample->packet, k->sample_packet, PACKET_LEN);
+        sample->timestamp = k->sample_time;
+        sample->digital = k->sample_digital;
+        atomic_thread_fence(memory_order_acquire);
+        seq2 = atomic_load_explicit(&k->sample_seq, memory_order_relaxed);
+    } while ((seq1 & 1) || seq1 != seq2);
+    return seq1;
+}
+
+/* Account one transfer attempt: its outcome and how long it took */
+static void CountTransfer(transfer_stats *stats, int status, uint64_t elapsed)
+{
+    unsigned long us = elapsed / 1000;
+    int bucket = 0;
+
+    while (bucket < K8055_HIST_BUCKETS - 1 && us > hist_bounds_us[bucket])
+        bucket++;
+    atomic_fetch_add_explicit(&stats->transfers, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats->time_ns, elapsed, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats->histogram[bucket], 1, memory_order_relaxed);
+    if (status == -ETIMEDOUT)
+        atomic_fetch_add_explicit(&stats->timeouts, 1, memory_order_relaxed);
+    else if (status < 0)
+        atomic_fetch_add_explicit(&stats->errors, 1, memory_order_relaxed);
+    else if (status < PACKET_LEN)
+        atomic_fetch_add_explicit(&stats->short_packets, 1, memory_order_relaxed);
+}
+
+static void Count(atomic_ulong *counter)
+{
+    atomic_fetch_add_explicit(counter, 1, memory_order_relaxed);
+}
+
+/* Count an output packet that was lost or never confirmed. Called with
+   io_lock held. */
+static void WriteError(k8055_dev *k, unsigned char cmd)
+{
+    k->outputs_known = 0;
+    atomic_fetch_add(&k->write_errors, 1);
+    if (k->write_error_cb != NULL)
+        k->write_error_cb(k, cmd, k->write_error_data);
+}
+
+/* A status that means the board went away (unplugged, or reset and
+   re-enumerated), rather than a packet that got lost */
+static int DeviceGone(int status)
+{
+    return status == -ENODEV || status == -EIO;
+}
+
+/* Remember what a command 5 packet that got through set the outputs to.
+   Called with io_lock held. */
+static void OutputsSent(k8055_dev *k, unsigned char cmd)
+{
+    if (cmd != CMD_SET_ANALOG_DIGITAL)
+        return;
+    memcpy(k->outputs_sent, &k->data_out[DIGITAL_OUT_OFFSET], 3);
+    k->outputs_known = 1;
+}
+
+/* Close the handle of a board that stopped answering; Reconnect() opens it
+   again. Called with io_lock held. */
+static void DeviceLost(k8055_dev *k)
+{
+    if (DEBUG)
+        fprintf(stderr, "Lost k8055 with address %d, reconnecting\n", (int)k->board_address);
+    k->transport->close(k->handle);
+    k->handle = NULL;
+    k->lost = 1;
+    k->outputs_known = 0;
+}
+
+/* Reopen a lost board and restore its outputs, which it lost with the
+   connection. Attempts back off from RECONNECT_MIN_DELAY to
+   RECONNECT_MAX_DELAY; the delay only resets once a transfer gets through,
+   so a board that opens but keeps failing can't loop. Called with io_lock
+   held. */
+static int Reconnect(k8055_dev *k)
+{
+    uint64_t now = MonotonicNow(), start;
+    int write_status;
+
+    if (now < k->reconnect_at)
+        return K8055_ERROR;
+    if (k->reconnect_delay == 0)
+        k->reconnect_delay = RECONNECT_MIN_DELAY;
+    else if ((k->reconnect_delay *= 2) > RECONNECT_MAX_DELAY)
+        k->reconnect_delay = RECONNECT_MAX_DELAY;
+    k->reconnect_at = now + k->reconnect_delay;
+
+    k->handle = k->transport->open(k->board_address);
+    if (k->handle == NULL)
+        return K8055_ERROR;
+    k->lost = 0;
+    pthread_mutex_lock(&k->sample_lock);
+    k->counters[0].valid = k->counters[1].valid = 0;
+    pthread_mutex_unlock(&k->sample_lock);
+
+    /* straight to the transport: a batch, the async writer or the skip
+       check must not hold back or drop the restore */
+    k->data_out[0] = CMD_SET_ANALOG_DIGITAL;
+    start = MonotonicNow();
+    write_status = k->transport->write(k->handle, k->data_out, PACKET_LEN, USB_TIMEOUT);
+    CountTransfer(&k->write_stats, write_status, MonotonicNow() - start);
+    if (write_status != PACKET_LEN)
+    {
+        Count(&k->write_stats.failures);
+        DeviceLost(k);
+        return K8055_ERROR;
+    }
+    OutputsSent(k, CMD_SET_ANALOG_DIGITAL);
+    atomic_fetch_add(&k->reconnects, 1);
+    if (DEBUG)
+        fprintf(stderr, "Reconnected k8055 with address %d\n", (int)k->board_address);
+    return 0;
+}
+
+/* Make sure there is a handle to transfer on. Called with io_lock held. */
+static int EnsureOpen(k8055_dev *k)
+{
+    if (k->handle != NULL)
+        return 0;
+    return k->lost ? Reconnect(k) : K8055_ERROR;
+}
+
+static int ReadK8055Data(k8055_dev *k)
+{
+    int read_status = 0, i = 0;
+    uint64_t start;
+
+    LockIO(k);
+    if (EnsureOpen(k) != 0)
+    {
+        Count(&k->read_stats.failures);
+        UnlockIO(k);
+        return K8055_ERROR;
+    }
+    for(i=0; i < 3; i++)
+        {
+        if (i > 0)
+            Count(&k->read_stats.retries);
+        start = MonotonicNow();
+        read_status = k->transport->read(k->handle, k->data_in, PACKET_LEN, USB_TIMEOUT);
+        CountTransfer(&k->read_stats, read_status, MonotonicNow() - start);
+        if (k->transport->skipped != NULL)
+            atomic_fetch_add_explicit(&k->read_stats.skipped, k->transport->skipped(k->handle),
+                                      memory_order_relaxed);
+        if ((read_status == PACKET_LEN) && (k->data_in[1] & 0x01))
+            {
+            k->confirm_pending = 0;
+            k->reconnect_delay = 0;
+            PublishSample(k);
+            UnlockIO(k);
+            return 0;
+            }
+        if (DEBUG)
+            fprintf(stderr, "Read retry\n");
+        if (atomic_load(&k->interrupted))
+            break;
+        }
+    Count(&k->read_stats.failures);
+    if (k->confirm_pending)
+    {
+        /* the board stopped answering after a deferred write */
+        k->confirm_pending = 0;
+        WriteError(k, k->pending_cmd);
+    }
+    if (k->auto_reconnect && DeviceGone(read_status))
+    {
+        DeviceLost(k);
+        if (Reconnect(k) == 0)
+        {
+            read_status = ReadK8055Data(k);
+            UnlockIO(k);
+            return read_status;
+        }
+    }
+    UnlockIO(k);
+    return K8055_ERROR;
+}
+
+static int WriteK8055Data(k8055_dev *k, unsigned char cmd)
+{
+    int write_status = 0, i = 0;
+    uint64_t start;
+
+    LockIO(k);
+    if (cmd == CMD_SET_ANALOG_DIGITAL && k->batch_depth > 0)
+    {
+        k->batch_dirty = 1;
+        UnlockIO(k);
+        return 0;
+    }
+    if (cmd == CMD_SET_ANALOG_DIGITAL && k->out_async && !k->out_sending)
+    {
+        /* the writer thread sends it, merged with any later changes */
+        pthread_mutex_lock(&k->out_lock);
+        k->out_staged++;
+        pthread_cond_broadcast(&k->out_cond);
+        pthread_mutex_unlock(&k->out_lock);
+        UnlockIO(k);
+        return 0;
+    }
+    if (cmd == CMD_SET_ANALOG_DIGITAL && k->outputs_known && k->handle != NULL &&
+        memcmp(k->outputs_sent, &k->data_out[DIGITAL_OUT_OFFSET], 3) == 0)
+    {
+        /* the board already has these outputs */
+        Count(&k->writes_skipped);
+        UnlockIO(k);
+        return 0;
+    }
+    if (EnsureOpen(k) != 0)
+        i = 3;      /* lost, and too early for another reopen */
+    k->data_out[0] = cmd;
+    for(; i < 3 && k->handle != NULL; i++)
+        {
+        if (i > 0)
+            Count(&k->write_stats.retries);
+        start = MonotonicNow();
+        write_status = k->transport->write(k->handle, k->data_out, PACKET_LEN, USB_TIMEOUT);
+        CountTransfer(&k->write_stats, write_status, MonotonicNow() - start);
+        if ((write_status == PACKET_LEN) && (k->write_mode != K8055_WRITE_CONFIRM))
+            {
+            /* no read back; a deferred write is confirmed by the next read */
+            k->reconnect_delay = 0;
+            if (k->write_mode == K8055_WRITE_DEFERRED)
+                {
+                k->confirm_pending = 1;
+                k->pending_cmd = cmd;
+                }
+            OutputsSent(k, cmd);
+            UnlockIO(k);
+            return 0;
+            }
+        if((write_status == PACKET_LEN) && (ReadK8055Data(k) == 0))
+            {
+            OutputsSent(k, cmd);
+            UnlockIO(k);
+            return 0;
+            }
+        if (DEBUG)
+            fprintf(stderr, "Write retry\n");
+        if (atomic_load(&k->interrupted))
+            break;
+        }
+    if (k->auto_reconnect && k->handle != NULL && DeviceGone(write_status))
+    {
+        DeviceLost(k);
+        if (Reconnect(k) == 0)
+        {
+            /* the reconnect restored the outputs; resend anything else */
+            write_status = cmd == CMD_SET_ANALOG_DIGITAL ? 0 : WriteK8055Data(k, cmd);
+            UnlockIO(k);
+            return write_status;
+        }
+    }
+    Count(&k->write_stats.failures);
+    if (k->write_mode != K8055_WRITE_CONFIRM)
+    {
+        WriteError(k, cmd);
+        UnlockIO(k);
+        return 0;
+    }
+    /* the packet may or may not have reached the board */
+    k->outputs_known = 0;
+    UnlockIO(k);
+    return K8055_ERROR;
+}
+
+/* Whether the cached sample is at most read_max_age old (never with 0) */
+static int FreshSample(k8055_dev *k, k8055_sample *sample)
+{
+    uint64_t max_age = atomic_load_explicit(&k->read_max_age, memory_order_relaxed);
+
+    return max_age > 0 && LoadSample(k, sample) && MonotonicNow() - sample->timestamp <= max_age;
+}
+
+/* Get the current input sample: straight from the cache while the
+   acquisition thread is running, from the read cache if it is within
+   read_max_age (see SetReadCacheAge()), otherwise with a fresh USB read. */
+static int FetchInput(k8055_dev *k, k8055_sample *sample)
+{
+    if (atomic_load(&k->acquiring))
+        return WaitSampleNewer(k, sample, 0, FIRST_SAMPLE_TIMEOUT, NULL);
+    if (FreshSample(k, sample))
+        return 0;
+
+    LockIO(k);
+    /* callers that queued behind a read share its packet */
+    if (FreshSample(k, sample))
+    {
+        UnlockIO(k);
+        return 0;
+    }
+    if (ReadK8055Data(k) != 0)
+    {
+        UnlockIO(k);
+        return K8055_ERROR;
+    }
+    LoadSample(k, sample);
+    UnlockIO(k);
+    return 0;
+}
+
+/* ---------------------------- libusb-0.1 transport ---------------------------- */
+
+#ifdef HAVE_USB_H
+
+/* libusb-0.1 keeps the bus list in globals, so boards opened from different
+   threads take turns enumerating it */
+static pthread_mutex_t bus_lock = PTHREAD_MUTEX_INITIALIZER;
+static int usb_initialised;
+
+/* Where each board address was last seen on the bus. Reopening a board
+   (connect, or a reconnect after a glitch) looks there first and only
+   rescans every bus when the board has moved. Protected by bus_lock. */
+static struct
+{
+    char bus[PATH_MAX + 1];
+    char device[PATH_MAX + 1];
+} bus_cache[4];
+
+static int takeover_device(usb_dev_handle * udev, int interface)
+{
+    char driver_name[STR_BUFF];
+
+    memset(driver_name, 0, STR_BUFF);
+    int ret = K8055_ERROR;
+
+    assert(udev != NULL);
+    ret = usb_get_driver_np(udev, interface, driver_name, sizeof(driver_name));
+    if (ret == 0)
+    {
+        if (DEBUG)
+            fprintf(stderr, "Got driver name: %s\n", driver_name);
+        if (0 > usb_detach_kernel_driver_np(udev, interface))
+        {
+            if (DEBUG)
+                fprintf(stderr, "Disconnect OS driver: %s\n", usb_strerror());
+        }
+        else if (DEBUG)
+            fprintf(stderr, "Disconnected OS driver: %s\n", usb_strerror());
+    }
+    else if (DEBUG)
+        fprintf(stderr, "get driver name: %s\n", usb_strerror());
+
+    /* claim interface */
+    if (usb_claim_interface(udev, interface) < 0)
+    {
+        if (DEBUG)
+            fprintf(stderr, "Claim interface error: %s\n", usb_strerror());
+        return K8055_ERROR;
+    }
+    else
+        usb_set_altinterface(udev, interface);
+    usb_set_configuration(udev, 1);
+
+    if (DEBUG)
+        {
+        fprintf(stderr, "Found interface %d\n", interface);
+        fprintf(stderr, "Took over the device\n");
+        }
+
+    return 0;
+}
+
+/* Rescan every bus and remember where each K8055 is */
+static void ScanBusses(void)
+{
+    struct usb_bus *bus;
+    struct usb_device *dev;
+    int address;
+
+    usb_find_busses();
+    usb_find_devices();
+    memset(bus_cache, 0, sizeof(bus_cache));
+    for (bus = usb_get_busses(); bus; bus = bus->next)
+    {
+        for (dev = bus->devices; dev; dev = dev->next)
+        {
+            address = dev->descriptor.idProduct - K8055_IPID;
+            if (dev->descriptor.idVendor == VELLEMAN_VENDOR_ID && address >= 0 && address <= 3)
+            {
+                strcpy(bus_cache[address].bus, bus->dirname);
+                strcpy(bus_cache[address].device, dev->filename);
+            }
+        }
+    }
+}
+
+/* The board at its cached place in the current bus list, or NULL */
+static struct usb_device *CachedDevice(long board_address)
+{
+    struct usb_bus *bus;
+    struct usb_device *dev;
+
+    if (bus_cache[board_address].bus[0] == 0)
+        return NULL;
+    for (bus = usb_get_busses(); bus; bus = bus->next)
+    {
+        if (strcmp(bus->dirname, bus_cache[board_address].bus) != 0)
+            continue;
+        for (dev = bus->devices; dev; dev = dev->next)
+            if (strcmp(dev->filename, bus_cache[board_address].device) == 0 &&
+                dev->descriptor.idVendor == VELLEMAN_VENDOR_ID &&
+                dev->descriptor.idProduct == K8055_IPID + board_address)
+                return dev;
+    }
+    return NULL;
+}
+
+static usb_dev_handle *OpenBoard(struct usb_device *dev)
+{
+    usb_dev_handle *device_handle = usb_open(dev);
+
+    if (device_handle == NULL)
+        return NULL;
+    if (DEBUG)
+        fprintf(stderr,
+                "Velleman Device Found @ Address %s Vendor 0x0%x Product ID 0x0%x\n",
+                dev->filename, dev->descriptor.idVendor,
+                dev->descriptor.idProduct);
+    if (takeover_device(device_handle, 0) < 0)
+    {
+        if (DEBUG)
+            fprintf(stderr,
+                    "Can not take over the device from the OS driver\n");
+        usb_close(device_handle);   /* close usb if we fail */
+        return NULL;
+    }
+    return device_handle;
+}
+
+static void *LibusbOpen(long board_address)
+{
+    struct usb_device *dev;
+    usb_dev_handle *device_handle = NULL;
+
+    pthread_mutex_lock(&bus_lock);
+    if (!usb_initialised)
+    {
+        usb_init();
+        usb_initialised = 1;
+    }
+    /* a board that was unplugged and replugged has a new device file, so
+       a stale cache entry fails to open and we fall back to a rescan */
+    dev = CachedDevice(board_address);
+    if (dev != NULL)
+        device_handle = OpenBoard(dev);
+    if (device_handle == NULL)
+    {
+        ScanBusses();
+        dev = CachedDevice(board_address);
+        if (dev != NULL)
+            device_handle = OpenBoard(dev);
+    }
+    pthread_mutex_unlock(&bus_lock);
+    return device_handle;
+}
+
+static int LibusbRead(void *handle, unsigned char *packet, int len, int timeout)
+{
+    return usb_interrupt_read(handle, USB_INP_EP, (char *)packet, len, timeout);
+}
+
+static int LibusbWrite(void *handle, unsigned char *packet, int len, int timeout)
+{
+    /* usb_interrupt_write requires 16-bit output, USB1.1 uses 8-bit. a small "feature" gained with USB2.0 */
+    return usb_interrupt_write(handle, USB_OUT_EP, (int *)packet, len, timeout);
+}
+
+static void LibusbClose(void *handle)
+{
+    usb_close(handle);
+}
+
+static const k8055_transport libusb_transport =
+{
+    "libusb",
+    LibusbOpen,
+    LibusbRead,
+    LibusbWrite,
+    LibusbClose,
+    NULL
+};
+
+#endif /* HAVE_USB_H */
+
+/* compiled-in hardware transports, in the order OpenDevice() tries them.
+   hidraw goes first since it leaves the kernel's HID driver bound. */
+static const k8055_transport *transports[] =
+{
+#ifdef HAVE_LINUX_HIDRAW_H
+    &hidraw_transport,
+#endif
+#ifdef HAVE_LIBUSB_H
+    &libusb1_transport,
+#endif
+#ifdef HAVE_USB_H
+    &libusb_transport,
+#endif
+    NULL
+};
+
+static const k8055_transport *FindTransport(const char *name)
+{
+    const k8055_transport **t;
+
+    for (t = transports; *t != NULL; t++)
+        if (strcmp((*t)->name, name) == 0)
+            return *t;
+    if (strcmp(sim_transport.name, name) == 0)
+        return &sim_transport;
+    return NULL;
+}
+
+/* ------------------------------------------------------------------------------- */
+
+k8055_dev *NewDevice(void)
+{
+    pthread_mutexattr_t attr;
+    pthread_condattr_t cattr;
+    k8055_dev *k = calloc(1, sizeof(k8055_dev));
+
+    if (k == NULL)
+        return NULL;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&k->io_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    pthread_mutex_init(&k->sample_lock, NULL);
+    pthread_mutex_init(&k->seq_lock, NULL);
+    pthread_mutex_init(&k->out_lock, NULL);
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+    pthread_cond_init(&k->sample_cond, &cattr);
+    pthread_cond_init(&k->edge_cond, &cattr);
+    pthread_cond_init(&k->seq_cond, &cattr);
+    pthread_cond_init(&k->out_cond, &cattr);
+    pthread_condattr_destroy(&cattr);
+    k->edge_last = -1;
+    k->digital_filtered = -1;
+    return k;
+}
+
+void FreeDevice(k8055_dev *k)
+{
+    if (k == NULL)
+        return;
+    if (k->handle != NULL || k->lost)
+        CloseDevice(k);
+    RecorderClose(k->recorder);
+    StopSequence(k);
+    pthread_cond_destroy(&k->out_cond);
+    pthread_mutex_destroy(&k->out_lock);
+    pthread_cond_destroy(&k->seq_cond);
+    pthread_mutex_destroy(&k->seq_lock);
+    pthread_cond_destroy(&k->edge_cond);
+    pthread_cond_destroy(&k->sample_cond);
+    pthread_mutex_destroy(&k->sample_lock);
+    pthread_mutex_destroy(&k->io_lock);
+    free(k);
+}
+
+/* Open board 0-3 through the named transport. With no name, the
+   K8055_TRANSPORT environment variable is used, and failing that every
+   compiled-in transport is tried in turn. */
+int OpenDeviceWith(k8055_dev *k, long board_address, const char *transport)
+{
+    const k8055_transport *named[2] = { NULL, NULL };
+    const k8055_transport **t = transports;
+
+    if (board_address < 0 || board_address > 3) {
+        fprintf(stderr, "Invalid board address: %ld. Must be between 0-3.\n", board_address);
+        return K8055_ERROR;              /* throw error instead of being nice */
+    }
+    if (k->handle != NULL || k->lost)
+        return K8055_ERROR;
+    if (transport == NULL)
+        transport = getenv("K8055_TRANSPORT");
+    if (transport != NULL)
+    {
+        named[0] = FindTransport(transport);
+        t = named;
+    }
+
+    for (; *t != NULL; t++)
+    {
+        k->handle = (*t)->open(board_address);
+        if (k->handle != NULL)
+        {
+            k->transport = *t;
+            k->board_address = board_address;
+            k->reconnect_at = k->reconnect_delay = 0;
+            /* the total starts from the board's value */
+            pthread_mutex_lock(&k->sample_lock);
+            k->counters[0].reset_pending = k->counters[1].reset_pending = 1;
+            pthread_mutex_unlock(&k->sample_lock);
+            k->digital_filtered = -1;
+            k->outputs_known = 0;
+            memset(k->data_out,0,8);	/* Write cmd 0, read data */
+            return WriteK8055Data(k, CMD_RESET);
+        }
+    }
+    if (DEBUG)
+    {
+        if (transport != NULL && named[0] == NULL)
+            fprintf(stderr, "Unknown K8055 transport: %s\n", transport);
+        else
+            fprintf(stderr, "Could not find velleman k8055 with address %d\n",
+                    (int)board_address);
+    }
+    return K8055_ERROR;
+}
+
+int OpenDevice(k8055_dev *k, long board_address)
+{
+    return OpenDeviceWith(k, board_address, NULL);
+}
+
+int CloseDevice(k8055_dev *k)
+{
+    if (k->handle == NULL && !k->lost)
+        return K8055_ERROR;
+    StopSequence(k);
+    SetAsyncOutput(k, 0);
+    StopAcquisition(k);
+    LockIO(k);
+    if (k->handle != NULL)
+        k->transport->close(k->handle);
+    k->handle = NULL;
+    k->lost = 0;
+    UnlockIO(k);
+    return 0;
+}
+
+/* With enable set, a board that drops off the bus (or is reset) is reopened
+   on the next transfer, with backoff, and gets its digital and analog
+   outputs back. Calls made while it is away fail as usual. */
+void SetAutoReconnect(k8055_dev *k, int enable)
+{
+    LockIO(k);
+    k->auto_reconnect = enable != 0;
+    UnlockIO(k);
+}
+
+int GetAutoReconnect(k8055_dev *k)
+{
+    return k->auto_reconnect;
+}
+
+unsigned long GetReconnects(k8055_dev *k)
+{
+    return atomic_load(&k->reconnects);
+}
+
+static void *AcquisitionThread(void *arg)
+{
+    k8055_dev *k = arg;
+
+    while (atomic_load(&k->acquiring))
+    {
+        if (ReadK8055Data(k) != 0)
+        {
+            /* board gone or busy; don't spin on the bus */
+            usleep(USB_TIMEOUT * 1000);
+            continue;
+        }
+        /* hand the bus to any caller queued behind us */
+        while (atomic_load(&k->io_waiters) > 0 && atomic_load(&k->acquiring))
+            sched_yield();
+    }
+    return NULL;
+}
+
+/* Append every input packet the board delivers, with its timestamp, to a
+   ring of `records` entries in the memory-mapped file at path. Stays on
+   across CloseDevice()/OpenDevice() until StopCapture(). */
+int StartCapture(k8055_dev *k, const char *path, unsigned long records)
+{
+    k8055_recorder *rec;
+
+    LockIO(k);
+    if (k->recorder != NULL)
+    {
+        UnlockIO(k);
+        return K8055_ERROR;
+    }
+    rec = RecorderOpen(path, records);
+    k->recorder = rec;
+    UnlockIO(k);
+    return rec != NULL ? 0 : K8055_ERROR;
+}
+
+int StopCapture(k8055_dev *k)
+{
+    LockIO(k);
+    if (k->recorder == NULL)
+    {
+        UnlockIO(k);
+        return K8055_ERROR;
+    }
+    RecorderClose(k->recorder);
+    k->recorder = NULL;
+    UnlockIO(k);
+    return 0;
+}
+
+/* Control a board opened with the "sim" transport. These return K8055_ERROR
+   for a board on any other transport. The board's handle is only used under
+   io_lock, since a reconnect can replace it. */
+static k8055_sim *LockSim(k8055_dev *k)
+{
+    LockIO(k);
+    if (k->handle == NULL || k->transport != &sim_transport)
+    {
+        UnlockIO(k);
+        return NULL;
+    }
+    return k->handle;
+}
+
+int ConfigureSimulator(k8055_dev *k, long latency_us, long jitter_us, double failure_rate)
+{
+    k8055_sim *sim = LockSim(k);
+
+    if (sim == NULL)
+        return K8055_ERROR;
+    SimConfigure(sim, latency_us, jitter_us, failure_rate);
+    UnlockIO(k);
+    return 0;
+}
+
+int SimulateInputs(k8055_dev *k, long digital, long analog1, long analog2)
+{
+    k8055_sim *sim = LockSim(k);
+
+    if (sim == NULL)
+        return K8055_ERROR;
+    SimSetInputs(sim, digital, analog1, analog2);
+    UnlockIO(k);
+    return 0;
+}
+
+int SimulateCounterPulses(k8055_dev *k, long counterno, long pulses)
+{
+    k8055_sim *sim;
+
+    if (counterno != 1 && counterno != 2)
+        return K8055_ERROR;
+    sim = LockSim(k);
+    if (sim == NULL)
+        return K8055_ERROR;
+    SimPulseCounter(sim, counterno, pulses);
+    UnlockIO(k);
+    return 0;
+}
+
+int SimulateUnplug(k8055_dev *k, long ms)
+{
+    k8055_sim *sim = LockSim(k);
+
+    if (sim == NULL)
+        return K8055_ERROR;
+    SimUnplug(sim, ms);
+    UnlockIO(k);
+    return 0;
+}
+
+int SimulatedOutputs(k8055_dev *k, long *digital, long *analog1, long *analog2)
+{
+    k8055_sim *sim = LockSim(k);
+
+    if (sim == NULL)
+        return K8055_ERROR;
+    SimGetOutputs(sim, digital, analog1, analog2);
+    UnlockIO(k);
+    return 0;
+}
+
+static void AddMicroseconds(struct timespec *ts, unsigned long us)
+{
+    ts->tv_sec += us / 1000000;
+    ts->tv_nsec += (us % 1000000) * 1000L;
+    if (ts->tv_nsec >= 1000000000L)
+    {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+static int TimeReached(const struct timespec *deadline)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec > deadline->tv_sec ||
+        (now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec);
+}
+
+/* Sends each frame and sleeps until an absolute CLOCK_MONOTONIC deadline, so
+   the time spent on the transfer doesn't add up over the sequence. When a
+   transfer runs past the end of its frame the deadline counts as missed and
+   the schedule restarts from there instead of rushing to catch up. */
+static void *SequenceThread(void *arg)
+{
+    k8055_dev *k = arg;
+    struct timespec deadline;
+    unsigned long pos = 0;
+    k8055_frame *f;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    pthread_mutex_lock(&k->seq_lock);
+    while (!k->seq_stop)
+    {
+        if (k->seq_seek >= 0)
+        {
+            pos = k->seq_seek;
+            k->seq_seek = -1;
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+        }
+        atomic_store(&k->seq_position, pos);
+        f = &k->seq_frames[pos];
+        pthread_mutex_unlock(&k->seq_lock);
+
+        LockIO(k);
+        k->data_out[1] = f->digital;
+        k->data_out[2] = f->analog1;
+        k->data_out[3] = f->analog2;
+        WriteK8055Data(k, CMD_SET_ANALOG_DIGITAL);
+        UnlockIO(k);
+
+        AddMicroseconds(&deadline, f->duration_us);
+        if (TimeReached(&deadline))
+        {
+            atomic_fetch_add(&k->seq_missed, 1);
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+        }
+
+        pthread_mutex_lock(&k->seq_lock);
+        while (!k->seq_stop && k->seq_seek < 0 &&
+               pthread_cond_timedwait(&k->seq_cond, &k->seq_lock, &deadline) != ETIMEDOUT)
+            ;
+        if (k->seq_seek >= 0)
+            continue;
+        if (++pos == k->seq_count)
+        {
+            if (!k->seq_loop)
+                break;
+            pos = 0;
+        }
+    }
+    atomic_store(&k->seq_playing, 0);
+    pthread_mutex_unlock(&k->seq_lock);
+    return NULL;
+}
+
+/* Play count frames on a thread of their own, once or (loop != 0) until
+   StopSequence(). The frames are copied. Replaces a sequence that is still
+   playing. */
+int PlaySequence(k8055_dev *k, const k8055_frame *frames, unsigned long count, int loop)
+{
+    k8055_frame *copy;
+    int closed;
+
+    /* a board that is only lost gets reopened by the player's first write */
+    LockIO(k);
+    closed = k->handle == NULL && !(k->lost && k->auto_reconnect);
+    UnlockIO(k);
+    if (closed || count == 0)
+        return K8055_ERROR;
+    copy = malloc(count * sizeof(k8055_frame));
+    if (copy == NULL)
+        return K8055_ERROR;
+    memcpy(copy, frames, count * sizeof(k8055_frame));
+    StopSequence(k);
+
+    pthread_mutex_lock(&k->seq_lock);
+    k->seq_frames = copy;
+    k->seq_count = count;
+    k->seq_loop = loop;
+    k->seq_seek = -1;
+    k->seq_stop = 0;
+    atomic_store(&k->seq_position, 0);
+    atomic_store(&k->seq_missed, 0);
+    atomic_store(&k->seq_playing, 1);
+    if (pthread_create(&k->seq_thread, NULL, SequenceThread, k) != 0)
+    {
+        atomic_store(&k->seq_playing, 0);
+        k->seq_frames = NULL;
+        pthread_mutex_unlock(&k->seq_lock);
+        free(copy);
+        return K8055_ERROR;
+    }
+    k->seq_running = 1;
+    pthread_mutex_unlock(&k->seq_lock);
+    return 0;
+}
+
+/* Stop the sequence after the frame being sent. The outputs keep the last
+   frame's values. */
+int StopSequence(k8055_dev *k)
+{
+    pthread_mutex_lock(&k->seq_lock);
+    if (!k->seq_running)
+    {
+        pthread_mutex_unlock(&k->seq_lock);
+        return 0;
+    }
+    k->seq_stop = 1;
+    k->seq_running = 0;
+    pthread_cond_broadcast(&k->seq_cond);
+    pthread_mutex_unlock(&k->seq_lock);
+
+    pthread_join(k->seq_thread, NULL);
+    free(k->seq_frames);
+    k->seq_frames = NULL;
+    return 0;
+}
+
+/* Jump to frame right away, restarting the schedule from it */
+int SeekSequence(k8055_dev *k, unsigned long frame)
+{
+    int rval = K8055_ERROR;
+
+    pthread_mutex_lock(&k->seq_lock);
+    if (atomic_load(&k->seq_playing) && frame < k->seq_count)
+    {
+        k->seq_seek = frame;
+        pthread_cond_broadcast(&k->seq_cond);
+        rval = 0;
+    }
+    pthread_mutex_unlock(&k->seq_lock);
+    return rval;
+}
+
+/* Returns 1 while a sequence is playing, 0 otherwise. frame gets the frame
+   being played (or the last one played), missed the number of frames that
+   were sent late. Either may be NULL. */
+int SequenceStatus(k8055_dev *k, unsigned long *frame, unsigned long *missed)
+{
+    if (frame != NULL)
+        *frame = atomic_load(&k->seq_position);
+    if (missed != NULL)
+        *missed = atomic_load(&k->seq_missed);
+    return atomic_load(&k->seq_playing);
+}
+
+int StartAcquisition(k8055_dev *k)
+{
+    if (k->handle == NULL)
+        return K8055_ERROR;
+    if (atomic_exchange(&k->acquiring, 1))
+        return 0;   /* already running */
+    if (pthread_create(&k->acq_thread, NULL, AcquisitionThread, k) != 0)
+    {
+        atomic_store(&k->acquiring, 0);
+        return K8055_ERROR;
+    }
+    return 0;
+}
+
+int StopAcquisition(k8055_dev *k)
+{
+    if (!atomic_exchange(&k->acquiring, 0))
+        return 0;
+    pthread_join(k->acq_thread, NULL);
+    return 0;
+}
 
-#define USB_OUT_EP 0x01	/* USB output endpoint */
-#define USB_INP_EP 0x81 /* USB Input endpoint */
+/* Make a blocked call on this board return early: transfers stop retrying
+   and WaitSampleNewer wakes up. Safe to call from any thread. The flag stays
+   set until ClearInterrupt(). */
+void InterruptDevice(k8055_dev *k)
+{
+    atomic_store(&k->interrupted, 1);
+    pthread_mutex_lock(&k->sample_lock);
+    pthread_cond_broadcast(&k->sample_cond);
+    pthread_mutex_unlock(&k->sample_lock);
+    pthread_mutex_lock(&k->out_lock);
+    pthread_cond_broadcast(&k->out_cond);
+    pthread_mutex_unlock(&k->out_lock);
+}
 
-#define USB_TIMEOUT 20
-#define K8055_ERROR -1
+void ClearInterrupt(k8055_dev *k)
+{
+    atomic_store(&k->interrupted, 0);
+}
 
-#define DIGITAL_INP_OFFSET 0
-#define DIGITAL_OUT_OFFSET 1
-#define ANALOG_1_OFFSET 2
-#define ANALOG_2_OFFSET 3
-#define COUNTER_1_OFFSET 4
-#define COUNTER_2_OFFSET 6
+/* End the one wait that was given cancel. Safe to call from any thread. */
+void CancelWait(k8055_dev *k, k8055_cancel *cancel)
+{
+    atomic_store(&cancel->cancelled, 1);
+    pthread_mutex_lock(&k->sample_lock);
+    pthread_cond_broadcast(&k->sample_cond);
+    pthread_mutex_unlock(&k->sample_lock);
+    pthread_mutex_lock(&k->out_lock);
+    pthread_cond_broadcast(&k->out_cond);
+    pthread_mutex_unlock(&k->out_lock);
+}
 
-#define CMD_RESET 0x00
-#define CMD_SET_DEBOUNCE_1 0x01
-#define CMD_SET_DEBOUNCE_2 0x01
-#define CMD_RESET_COUNTER_1 0x03
-#define CMD_RESET_COUNTER_2 0x04
-#define CMD_SET_ANALOG_DIGITAL 0x05
+/* Whether a wait should give up: its own cancel flag if it has one, else
+   the device-wide InterruptDevice() flag */
+static int WaitCancelled(k8055_dev *k, k8055_cancel *cancel)
+{
+    return cancel != NULL ? atomic_load(&cancel->cancelled) : atomic_load(&k->interrupted);
+}
 
-/* set debug to 0 to not print excess info */
-int DEBUG = 1;
+int IsAcquiring(k8055_dev *k)
+{
+    return atomic_load(&k->acquiring);
+}
 
-/* variables for usb */
-static struct usb_bus *bus, *busses;
-static struct usb_device *dev;
-static usb_dev_handle *device_handle = '\0';
+int ReadLatestSample(k8055_dev *k, k8055_sample *sample)
+{
+    return LoadSample(k, sample) ? 0 : K8055_ERROR;
+}
 
-/* globals for datatransfer */
-unsigned char data_in[PACKET_LEN+1], data_out[PACKET_LEN+1];
+int WaitSampleNewer(k8055_dev *k, k8055_sample *sample, uint64_t after, long timeout_ms,
+                    k8055_cancel *cancel)
+{
+    struct timespec deadline;
+    int rval = 0;
 
-/* char* device_id[]; */
+    if (LoadSample(k, sample) && sample->timestamp > after)
+        return 0;
 
-static int ReadK8055Data(void)
-{
-    int read_status = 0, i = 0;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
 
-    for(i=0; i < 3; i++)
+    pthread_mutex_lock(&k->sample_lock);
+    while (rval != ETIMEDOUT && !WaitCancelled(k, cancel))
+    {
+        if (LoadSample(k, sample) && sample->timestamp > after)
         {
-        read_status = usb_interrupt_read(device_handle, USB_INP_EP, (char *)data_in, PACKET_LEN, USB_TIMEOUT);
-        if ((read_status == PACKET_LEN) && (data_in[1] & 0x01)) return 0;
-        if (DEBUG)
-            fprintf(stderr, "Read retry\n");
+            pthread_mutex_unlock(&k->sample_lock);
+            return 0;
         }
+        rval = pthread_cond_timedwait(&k->sample_cond, &k->sample_lock, &deadline);
+    }
+    pthread_mutex_unlock(&k->sample_lock);
     return K8055_ERROR;
 }
 
-static int WriteK8055Data(unsigned char cmd)
+/* Sleep until the CLOCK_MONOTONIC time `when` (ns). Sleeps in slices of at
+   most SLEEP_SLICE so a cancel is noticed. Returns K8055_ERROR when
+   cancelled. */
+static int SleepUntil(k8055_dev *k, uint64_t when, k8055_cancel *cancel)
 {
-    int write_status = 0, i = 0;
+    struct timespec ts;
+    uint64_t now, until;
 
-    data_out[0] = cmd;
-    for(i=0; i < 3; i++)
-        {
-	/* usb_interrupt_write requires 16-bit output, USB1.1 uses 8-bit. a small "feature" gained with USB2.0 */
-        write_status = usb_interrupt_write(device_handle, USB_OUT_EP, (int *)data_out, PACKET_LEN, USB_TIMEOUT);
-        if((write_status == PACKET_LEN) && (ReadK8055Data() == 0)) return 0;
-        if (DEBUG)
-            fprintf(stderr, "Write retry\n");
-        }
+    while (!WaitCancelled(k, cancel))
+    {
+        now = MonotonicNow();
+        if (now >= when)
+            return 0;
+        until = when - now > SLEEP_SLICE ? now + SLEEP_SLICE : when;
+        ts.tv_sec = until / 1000000000ULL;
+        ts.tv_nsec = until % 1000000000ULL;
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+    }
     return K8055_ERROR;
 }
 
-static int takeover_device(usb_dev_handle * udev, int interface)
+/* A packet received after `after`: the acquisition thread's next one while
+   it runs, otherwise a read of our own. Never answered from the read cache. */
+static int ReadSampleAfter(k8055_dev *k, k8055_sample *sample, uint64_t after, k8055_cancel *cancel)
 {
-    char driver_name[STR_BUFF];
+    int rval;
 
-    memset(driver_name, 0, STR_BUFF);
-    int ret = K8055_ERROR;
+    if (atomic_load(&k->acquiring))
+        return WaitSampleNewer(k, sample, after, FIRST_SAMPLE_TIMEOUT, cancel);
+    LockIO(k);
+    rval = ReadK8055Data(k);
+    if (rval == 0)
+        LoadSample(k, sample);
+    UnlockIO(k);
+    return rval;
+}
 
-    assert(udev != NULL);
-    ret = usb_get_driver_np(udev, interface, driver_name, sizeof(driver_name));
-    if (ret == 0)
+/* Take count samples, one every interval_us, into samples. Each read starts
+   at an absolute CLOCK_MONOTONIC deadline, so the read time doesn't add up
+   over the run. A read that runs past the next deadline counts as missed and
+   the schedule restarts from there, like the sequence player. Every sample
+   is a packet newer than the one before, so with interval_us 0 the run
+   goes as fast as packets arrive. Other calls on the board can interleave
+   with it.
+   The first sample is due at start (CLOCK_MONOTONIC ns, 0 for right away);
+   pass the previous run's stats.next_deadline to carry on its schedule.
+   Returns the number of samples taken: fewer than count when a read failed
+   or the run was cancelled, K8055_ERROR if not even the first one could be
+   read. stats and cancel may be NULL. */
+long AcquireSamples(k8055_dev *k, k8055_sample *samples, unsigned long count,
+                    unsigned long interval_us, uint64_t start, k8055_acquire_stats *stats,
+                    k8055_cancel *cancel)
+{
+    uint64_t deadline = start > 0 ? start : MonotonicNow(), interval = interval_us * 1000ULL, late, now;
+    uint64_t after;
+    unsigned long n, missed = 0;
+    double mean = 0, m2 = 0, delta;
+    uint64_t late_max = 0;
+
+    for (n = 0; n < count; n++)
     {
-        if (DEBUG)
-            fprintf(stderr, "Got driver name: %s\n", driver_name);
-        if (0 > usb_detach_kernel_driver_np(udev, interface))
+        after = n > 0 && samples[n - 1].timestamp > deadline ? samples[n - 1].timestamp : deadline;
+        if (SleepUntil(k, deadline, cancel) != 0 ||
+            ReadSampleAfter(k, &samples[n], after, cancel) != 0)
+            break;
+        /* running mean and variance (Welford) of how late each packet came */
+        late = samples[n].timestamp > deadline ? samples[n].timestamp - deadline : 0;
+        if (late > late_max)
+            late_max = late;
+        delta = late - mean;
+        mean += delta / (n + 1);
+        m2 += delta * (late - mean);
+
+        deadline += interval;
+        now = MonotonicNow();
+        if (interval > 0 && n + 1 < count && now > deadline)
         {
-            if (DEBUG)
-                fprintf(stderr, "Disconnect OS driver: %s\n", usb_strerror());
+            missed++;
+            deadline = now;
         }
-        else if (DEBUG)
-            fprintf(stderr, "Disconnected OS driver: %s\n", usb_strerror());
     }
-    else if (DEBUG)
-        fprintf(stderr, "get driver name: %s\n", usb_strerror());
-
-    /* claim interface */
-    if (usb_claim_interface(udev, interface) < 0)
+    if (stats != NULL)
     {
-        if (DEBUG)
-            fprintf(stderr, "Claim interface error: %s\n", usb_strerror());
-        return K8055_ERROR;
+        stats->count = n;
+        stats->missed = missed;
+        stats->lateness_max_ns = late_max;
+        stats->lateness_mean_ns = mean;
+        stats->lateness_stddev_ns = n > 1 ? sqrt(m2 / (n - 1)) : 0;
+        stats->next_deadline = deadline;
     }
-    else
-        usb_set_altinterface(udev, interface);
-    usb_set_configuration(udev, 1);
-
-    if (DEBUG)
-        {
-        fprintf(stderr, "Found interface %d\n", interface);
-        fprintf(stderr, "Took over the device\n");
-        }
+    return n == 0 && count > 0 ? K8055_ERROR : (long)n;
+}
 
+/* Start (enable = 1) or stop queueing digital input transitions. Edges are
+   only seen in packets that are actually read, so run the acquisition thread
+   to catch them all. Enabling clears the queue; disabling wakes WaitEdges(). */
+int WatchEdges(k8055_dev *k, int enable)
+{
+    pthread_mutex_lock(&k->sample_lock);
+    k->edge_head = k->edge_count = 0;
+    k->edge_last = -1;
+    atomic_store(&k->edge_watch, enable != 0);
+    pthread_cond_broadcast(&k->edge_cond);
+    pthread_mutex_unlock(&k->sample_lock);
     return 0;
 }
 
-int OpenDevice(long board_address)
+/* Wait up to timeout_ms (forever if < 0) for digital transitions and move
+   up to max of them, oldest first, into edges. Returns how many, 0 on a
+   timeout or CancelEdgeWait(), K8055_ERROR when edges aren't watched. */
+int WaitEdges(k8055_dev *k, k8055_edge *edges, int max, long timeout_ms)
 {
-    unsigned char located = 0;
-    int ipid;
+    struct timespec deadline;
+    int rval = 0, n = 0;
 
-    /* init USB and find all of the devices on all busses */
-    usb_init();
-    usb_find_busses();
-    usb_find_devices();
-    busses = usb_get_busses();
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
 
-    /* ID of the welleman board is 5500h + address config */
-    if (board_address >= 0 && board_address < 4) {
-        ipid = K8055_IPID + (int)board_address;
-    } else {
-        fprintf(stderr, "Invalid board address: %ld. Must be between 0-3.\n", board_address);
-        return K8055_ERROR;              /* throw error instead of being nice */
+    pthread_mutex_lock(&k->sample_lock);
+    while (k->edge_count == 0 && atomic_load(&k->edge_watch) && !k->edge_cancel &&
+           rval != ETIMEDOUT)
+    {
+        if (timeout_ms < 0)
+            pthread_cond_wait(&k->edge_cond, &k->sample_lock);
+        else
+            rval = pthread_cond_timedwait(&k->edge_cond, &k->sample_lock, &deadline);
     }
-    /* start looping through the devices to find the correct one */
-    for (bus = busses; bus; bus = bus->next)
+    k->edge_cancel = 0;
+    if (!atomic_load(&k->edge_watch))
+        n = K8055_ERROR;
+    while (n >= 0 && n < max && k->edge_count > 0)
     {
-        for (dev = bus->devices; dev; dev = dev->next)
-        {
-            if ((dev->descriptor.idVendor == VELLEMAN_VENDOR_ID) &&
-                (dev->descriptor.idProduct == ipid))
-            {
-                located++;
-                device_handle = usb_open(dev);
-                if (DEBUG)
-                    fprintf(stderr,
-                            "Velleman Device Found @ Address %s Vendor 0x0%x Product ID 0x0%x\n",
-                            dev->filename, dev->descriptor.idVendor,
-                            dev->descriptor.idProduct);
-                if (takeover_device(device_handle, 0) < 0)
-                {
-                    if (DEBUG)
-                        fprintf(stderr,
-                                "Can not take over the device from the OS driver\n");
-                    usb_close(device_handle);   /* close usb if we fail */
-                    return K8055_ERROR;  /* throw K8055_ERROR to show that OpenDevice failed */
-                }
-                else
-                {
-                    memset(data_out,0,8);	/* Write cmd 0, read data */
-                    return WriteK8055Data(CMD_RESET);
-                }
-            }
-        }
+        edges[n++] = k->edge_queue[k->edge_head];
+        k->edge_head = (k->edge_head + 1) % EDGE_QUEUE_LEN;
+        k->edge_count--;
     }
-    if (DEBUG)
-        fprintf(stderr, "Could not find velleman k8055 with address %d\n",
-                (int)board_address);
-    return K8055_ERROR;
+    pthread_mutex_unlock(&k->sample_lock);
+    return n;
 }
 
-int CloseDevice()
+/* Make a WaitEdges() in progress (or the next one) return 0 */
+void CancelEdgeWait(k8055_dev *k)
 {
-    return usb_close(device_handle);
+    pthread_mutex_lock(&k->sample_lock);
+    k->edge_cancel = 1;
+    pthread_cond_broadcast(&k->edge_cond);
+    pthread_mutex_unlock(&k->sample_lock);
 }
 
-long ReadAnalogChannel(long channel)
+/* edges lost because the queue was full */
+unsigned long GetEdgesDropped(k8055_dev *k)
 {
+    unsigned long dropped;
+
+    pthread_mutex_lock(&k->sample_lock);
+    dropped = k->edges_dropped;
+    pthread_mutex_unlock(&k->sample_lock);
+    return dropped;
+}
+
+long ReadAnalogChannel(k8055_dev *k, long channel)
+{
+    k8055_sample sample;
+
     if (channel == 1 || channel == 2)
     {
-        if ( ReadK8055Data() == 0)
+        if (FetchInput(k, &sample) == 0)
         {
             if (channel == 2)
-                return data_in[ANALOG_2_OFFSET];
+                return sample.packet[ANALOG_2_OFFSET];
             else
-                return data_in[ANALOG_1_OFFSET];
+                return sample.packet[ANALOG_1_OFFSET];
         }
         else
             return K8055_ERROR;
@@ -273,189 +1768,565 @@ long ReadAnalogChannel(long channel)
         return K8055_ERROR;
 }
 
-int ReadAllAnalog(long *data1, long *data2)
+int ReadAllAnalog(k8055_dev *k, long *data1, long *data2)
 {
-    if (ReadK8055Data() == 0)
+    k8055_sample sample;
+
+    if (FetchInput(k, &sample) == 0)
     {
-        *data1 = data_in[ANALOG_1_OFFSET];
-        *data2 = data_in[ANALOG_2_OFFSET];
+        *data1 = sample.packet[ANALOG_1_OFFSET];
+        *data2 = sample.packet[ANALOG_2_OFFSET];
         return 0;
     }
     else
         return K8055_ERROR;
 }
 
-int OutputAnalogChannel(long channel, long data)
+/* Filter analog input channel over its last `window` packets (at most
+   K8055_FILTER_MAX_WINDOW; 0 turns the filter off), and smooth it with an
+   exponential moving average that gives the newest packet weight alpha
+   (0 < alpha <= 1). Every packet received from then on updates it, so run
+   the acquisition thread to filter at the board's full rate. Restarts the
+   window. */
+int SetAnalogFilter(k8055_dev *k, long channel, unsigned long window, double alpha)
+{
+    analog_filter *f;
+
+    if ((channel != 1 && channel != 2) || window > K8055_FILTER_MAX_WINDOW ||
+        !(alpha > 0 && alpha <= 1))
+        return K8055_ERROR;
+    f = &k->filters[channel - 1];
+    pthread_mutex_lock(&k->sample_lock);
+    memset(f, 0, sizeof(*f));
+    f->window = window;
+    f->alpha = alpha;
+    pthread_mutex_unlock(&k->sample_lock);
+    return 0;
+}
+
+/* The filtered values of analog input channel as of the last packet; no USB
+   transfer. K8055_ERROR for a bad channel or one without a filter. */
+int ReadAnalogFilter(k8055_dev *k, long channel, k8055_analog_stats *stats)
+{
+    int rval = K8055_ERROR;
+
+    if (channel != 1 && channel != 2)
+        return K8055_ERROR;
+    pthread_mutex_lock(&k->sample_lock);
+    if (k->filters[channel - 1].window > 0)
+    {
+        *stats = k->filters[channel - 1].stats;
+        rval = 0;
+    }
+    pthread_mutex_unlock(&k->sample_lock);
+    return rval;
+}
+
+int OutputAnalogChannel(k8055_dev *k, long channel, long data)
 {
+    int rval;
+
     if (channel == 1 || channel == 2)
     {
+        LockIO(k);
         if (channel == 2)
-            data_out[ANALOG_2_OFFSET] = (unsigned char)data;
+            k->data_out[ANALOG_2_OFFSET] = (unsigned char)data;
         else
-            data_out[ANALOG_1_OFFSET] = (unsigned char)data;
+            k->data_out[ANALOG_1_OFFSET] = (unsigned char)data;
 
-        return WriteK8055Data(CMD_SET_ANALOG_DIGITAL);
+        rval = WriteK8055Data(k, CMD_SET_ANALOG_DIGITAL);
+        UnlockIO(k);
+        return rval;
     }
     else
         return K8055_ERROR;
 }
 
-int OutputAllAnalog(long data1, long data2)
+int OutputAllAnalog(k8055_dev *k, long data1, long data2)
+{
+    int rval;
+
+    LockIO(k);
+    k->data_out[2] = (unsigned char)data1;
+    k->data_out[3] = (unsigned char)data2;
+
+    rval = WriteK8055Data(k, CMD_SET_ANALOG_DIGITAL);
+    UnlockIO(k);
+    return rval;
+}
+
+/* The output state as last set through this context (including staged
+   batch changes and the sequence player's frames), digital as a bitmask
+   with output 1 = bit 0. No USB transfer: the board can't report its
+   outputs. */
+int GetOutputs(k8055_dev *k, long *digital, long *analog1, long *analog2)
 {
-    data_out[2] = (unsigned char)data1;
-    data_out[3] = (unsigned char)data2;
+    LockIO(k);
+    *digital = k->data_out[DIGITAL_OUT_OFFSET];
+    *analog1 = k->data_out[ANALOG_1_OFFSET];
+    *analog2 = k->data_out[ANALOG_2_OFFSET];
+    UnlockIO(k);
+    return 0;
+}
 
-    return WriteK8055Data(CMD_SET_ANALOG_DIGITAL);
+/* command 5 writes skipped because the board already had those outputs */
+unsigned long GetWritesSkipped(k8055_dev *k)
+{
+    return atomic_load(&k->writes_skipped);
 }
 
-int ClearAllAnalog()
+int ClearAllAnalog(k8055_dev *k)
 {
-    return OutputAllAnalog(0, 0);
+    return OutputAllAnalog(k, 0, 0);
 }
 
-int ClearAnalogChannel(long channel)
+int ClearAnalogChannel(k8055_dev *k, long channel)
 {
     if (channel == 1 || channel == 2)
     {
         if (channel == 2)
-            return OutputAnalogChannel(2, 0);
+            return OutputAnalogChannel(k, 2, 0);
         else
-            return OutputAnalogChannel(1, 0);
+            return OutputAnalogChannel(k, 1, 0);
     }
     else
         return K8055_ERROR;
 }
 
-int SetAnalogChannel(long channel)
+int SetAnalogChannel(k8055_dev *k, long channel)
 {
     if (channel == 1 || channel == 2)
     {
         if (channel == 2)
-            return OutputAnalogChannel(2, 0xff);
+            return OutputAnalogChannel(k, 2, 0xff);
         else
-            return OutputAnalogChannel(1, 0xff);
+            return OutputAnalogChannel(k, 1, 0xff);
     }
     else
         return K8055_ERROR;
 
 }
 
-int SetAllAnalog()
+int SetAllAnalog(k8055_dev *k)
 {
-    return OutputAllAnalog(0xff, 0xff);
+    return OutputAllAnalog(k, 0xff, 0xff);
 }
 
-int WriteAllDigital(long data)
+int WriteAllDigital(k8055_dev *k, long data)
 {
-    data_out[1] = (unsigned char)data;
-    return WriteK8055Data(CMD_SET_ANALOG_DIGITAL);
+    int rval;
+
+    LockIO(k);
+    k->data_out[1] = (unsigned char)data;
+    rval = WriteK8055Data(k, CMD_SET_ANALOG_DIGITAL);
+    UnlockIO(k);
+    return rval;
 }
 
-int ClearDigitalChannel(long channel)
+int ClearDigitalChannel(k8055_dev *k, long channel)
 {
     unsigned char data;
+    int rval;
 
     if (channel > 0 && channel < 9)
     {
-        data = data_out[1] ^ (1 << (channel-1));
-        return WriteAllDigital(data);
+        /* hold the lock so a concurrent update of another bit isn't lost */
+        LockIO(k);
+        data = k->data_out[1] & ~(1 << (channel-1));
+        rval = WriteAllDigital(k, data);
+        UnlockIO(k);
+        return rval;
     }
     else
         return K8055_ERROR;
 }
 
-int ClearAllDigital()
+int ClearAllDigital(k8055_dev *k)
 {
-    return WriteAllDigital(0x00);
+    return WriteAllDigital(k, 0x00);
 }
 
-int SetDigitalChannel(long channel)
+int SetDigitalChannel(k8055_dev *k, long channel)
 {
     unsigned char data;
+    int rval;
 
     if (channel > 0 && channel < 9)
     {
-        data = data_out[1] | (1 << (channel-1));
-        return WriteAllDigital(data);
+        /* hold the lock so a concurrent update of another bit isn't lost */
+        LockIO(k);
+        data = k->data_out[1] | (1 << (channel-1));
+        rval = WriteAllDigital(k, data);
+        UnlockIO(k);
+        return rval;
     }
     else
         return K8055_ERROR;
 }
 
-int SetAllDigital()
+int SetAllDigital(k8055_dev *k)
+{
+    return WriteAllDigital(k, 0xff);
+}
+
+/* Debounce digital input channel (1-5) in software: a change is only seen
+   once the input has kept its new value for time_us and for samples
+   consecutive packets (either may be 0). Every packet received counts, so
+   run the acquisition thread for the timing to be fine-grained. Reads,
+   samples and edge events all get the debounced value; the raw packet is
+   unchanged. */
+int SetDigitalDebounce(k8055_dev *k, long channel, long time_us, unsigned long samples)
+{
+    if (channel < 1 || channel > 5 || time_us < 0)
+        return K8055_ERROR;
+    LockIO(k);
+    k->debounce[channel - 1].min_time = time_us * 1000ULL;
+    k->debounce[channel - 1].min_samples = samples;
+    UnlockIO(k);
+    return 0;
+}
+
+int GetDigitalDebounce(k8055_dev *k, long channel, long *time_us, unsigned long *samples)
+{
+    if (channel < 1 || channel > 5)
+        return K8055_ERROR;
+    LockIO(k);
+    *time_us = k->debounce[channel - 1].min_time / 1000;
+    *samples = k->debounce[channel - 1].min_samples;
+    UnlockIO(k);
+    return 0;
+}
+
+/* input changes the debounce dropped because they reverted too soon */
+unsigned long GetDigitalGlitches(k8055_dev *k)
 {
-    return WriteAllDigital(0xff);
+    return atomic_load(&k->glitches);
 }
 
-int ReadDigitalChannel(long channel)
+int ReadDigitalChannel(k8055_dev *k, long channel)
 {
     int rval;
     if (channel > 0 && channel < 9)
     {
-        if ((rval = ReadAllDigital()) == K8055_ERROR) return K8055_ERROR;
+        if ((rval = ReadAllDigital(k)) == K8055_ERROR) return K8055_ERROR;
         return ((rval & (1 << (channel-1))) > 0);
     }
     else
         return K8055_ERROR;
 }
 
-long ReadAllDigital()
+long ReadAllDigital(k8055_dev *k)
 {
-    int return_data = 0;
-
-    if (ReadK8055Data() == 0)
-    {
-	return_data = (
-		((data_in[0] >> 4) & 0x03) |  /* Input 1 and 2 */
-		((data_in[0] << 2) & 0x04) |  /* Input 3 */
-		((data_in[0] >> 3) & 0x18) ); /* Input 4 and 5 */
+    k8055_sample sample;
 
-        return return_data;
-    }
+    if (FetchInput(k, &sample) == 0)
+        return sample.digital;
     else
         return K8055_ERROR;
 }
 
-int ReadAllValues(long int *data1, long int * data2, long int * data3, long int * data4, long int * data5)
+int ReadAllValues(k8055_dev *k, long int *data1, long int * data2, long int * data3, long int * data4, long int * data5)
 {
-    if (ReadK8055Data() == 0)
+    k8055_sample sample;
+
+    if (FetchInput(k, &sample) == 0)
     {
-	*data1 = (
-		((data_in[0] >> 4) & 0x03) |  /* Input 1 and 2 */
-		((data_in[0] << 2) & 0x04) |  /* Input 3 */
-		((data_in[0] >> 3) & 0x18) ); /* Input 4 and 5 */
-        *data2 = data_in[ANALOG_1_OFFSET];
-        *data3 = data_in[ANALOG_2_OFFSET];
-        *data4 = *((short int *)(&data_in[COUNTER_2_OFFSET]));
-        *data5 = *((short int *)(&data_in[COUNTER_1_OFFSET]));
- 	return 0;
+        DecodeValues(sample.packet, data1, data2, data3, data4, data5);
+        *data1 = sample.digital;
+        return 0;
     }
     else
         return K8055_ERROR;
 }
 
-int ResetCounter(long counterno)
+int ReadSample(k8055_dev *k, k8055_sample *sample)
+{
+    return FetchInput(k, sample);
+}
+
+/* every value is decoded from the same input packet */
+void DecodeValues(const unsigned char *packet, long int *data1, long int * data2, long int * data3, long int * data4, long int * data5)
+{
+    *data1 = DecodeDigital(packet);
+    *data2 = packet[ANALOG_1_OFFSET];
+    *data3 = packet[ANALOG_2_OFFSET];
+    *data4 = DecodeCounter(packet, COUNTER_1_OFFSET);
+    *data5 = DecodeCounter(packet, COUNTER_2_OFFSET);
+}
+
+/* Let input reads reuse a packet up to max_age_us old instead of reading the
+   board again; 0 (the default) reads every time. Concurrent callers that
+   wait for the same read all get its packet. */
+void SetReadCacheAge(k8055_dev *k, long max_age_us)
+{
+    atomic_store(&k->read_max_age, max_age_us > 0 ? max_age_us * 1000ULL : 0);
+}
+
+long GetReadCacheAge(k8055_dev *k)
+{
+    return atomic_load(&k->read_max_age) / 1000;
+}
+
+int SetWriteMode(k8055_dev *k, int mode)
+{
+    if (mode != K8055_WRITE_CONFIRM && mode != K8055_WRITE_NO_CONFIRM &&
+        mode != K8055_WRITE_DEFERRED)
+        return K8055_ERROR;
+    LockIO(k);
+    k->write_mode = mode;
+    UnlockIO(k);
+    return 0;
+}
+
+int GetWriteMode(k8055_dev *k)
+{
+    return k->write_mode;
+}
+
+unsigned long GetWriteErrors(k8055_dev *k)
+{
+    return atomic_load(&k->write_errors);
+}
+
+static void LoadTransferStats(transfer_stats *from, k8055_transfer_stats *to)
+{
+    int i;
+
+    to->transfers = atomic_load_explicit(&from->transfers, memory_order_relaxed);
+    to->retries = atomic_load_explicit(&from->retries, memory_order_relaxed);
+    to->timeouts = atomic_load_explicit(&from->timeouts, memory_order_relaxed);
+    to->short_packets = atomic_load_explicit(&from->short_packets, memory_order_relaxed);
+    to->errors = atomic_load_explicit(&from->errors, memory_order_relaxed);
+    to->failures = atomic_load_explicit(&from->failures, memory_order_relaxed);
+    to->skipped = atomic_load_explicit(&from->skipped, memory_order_relaxed);
+    to->time_ns = atomic_load_explicit(&from->time_ns, memory_order_relaxed);
+    for (i = 0; i < K8055_HIST_BUCKETS; i++)
+        to->histogram[i] = atomic_load_explicit(&from->histogram[i], memory_order_relaxed);
+}
+
+static void ClearTransferStats(transfer_stats *stats)
+{
+    int i;
+
+    atomic_store(&stats->transfers, 0);
+    atomic_store(&stats->retries, 0);
+    atomic_store(&stats->timeouts, 0);
+    atomic_store(&stats->short_packets, 0);
+    atomic_store(&stats->errors, 0);
+    atomic_store(&stats->failures, 0);
+    atomic_store(&stats->skipped, 0);
+    atomic_store(&stats->time_ns, 0);
+    for (i = 0; i < K8055_HIST_BUCKETS; i++)
+        atomic_store(&stats->histogram[i], 0);
+}
+
+/* Copy the board's transfer counters. Each counter is read atomically, but
+   transfers may complete while they are copied. */
+void GetStats(k8055_dev *k, k8055_stats *stats)
+{
+    LoadTransferStats(&k->read_stats, &stats->read);
+    LoadTransferStats(&k->write_stats, &stats->write);
+}
+
+void ResetStats(k8055_dev *k)
+{
+    ClearTransferStats(&k->read_stats);
+    ClearTransferStats(&k->write_stats);
+}
+
+/* cb runs on whichever thread noticed the failure, with the board's I/O
+   lock held, so it must not call back into libk8055 for this board */
+void SetWriteErrorCallback(k8055_dev *k, k8055_write_error_cb cb, void *data)
+{
+    LockIO(k);
+    k->write_error_cb = cb;
+    k->write_error_data = data;
+    UnlockIO(k);
+}
+
+/* Sends the latest data_out whenever it has changed since the last packet,
+   as fast as the board takes them. A failed write (in K8055_WRITE_CONFIRM
+   mode) is retried after USB_TIMEOUT, with whatever data_out holds by then.
+   Once stopped, it exits when everything staged has been sent. */
+static void *OutputThread(void *arg)
+{
+    k8055_dev *k = arg;
+    unsigned long gen;
+    int rval;
+
+    pthread_mutex_lock(&k->out_lock);
+    for (;;)
+    {
+        while (!k->out_stop && k->out_written == k->out_staged)
+            pthread_cond_wait(&k->out_cond, &k->out_lock);
+        if (k->out_written == k->out_staged)
+            break;
+        pthread_mutex_unlock(&k->out_lock);
+
+        LockIO(k);
+        pthread_mutex_lock(&k->out_lock);
+        gen = k->out_staged;
+        pthread_mutex_unlock(&k->out_lock);
+        k->out_sending = 1;
+        rval = WriteK8055Data(k, CMD_SET_ANALOG_DIGITAL);
+        k->out_sending = 0;
+        UnlockIO(k);
+
+        pthread_mutex_lock(&k->out_lock);
+        if (rval == 0 || k->out_stop)
+            k->out_written = gen;   /* when stopping, a failed write is dropped */
+        pthread_cond_broadcast(&k->out_cond);
+        if (rval != 0 && !k->out_stop)
+        {
+            pthread_mutex_unlock(&k->out_lock);
+            usleep(USB_TIMEOUT * 1000);
+            pthread_mutex_lock(&k->out_lock);
+        }
+    }
+    pthread_mutex_unlock(&k->out_lock);
+    return NULL;
+}
+
+/* With enable set, digital and analog output calls only update the staged
+   outputs and return at once; a writer thread sends the latest state as
+   fast as the board accepts packets, so changes made in between collapse
+   into one packet. FlushOutputs() waits for them to go out. Disabling
+   sends whatever is still staged first. */
+int SetAsyncOutput(k8055_dev *k, int enable)
+{
+    if (enable)
+    {
+        if (k->handle == NULL)
+            return K8055_ERROR;
+        pthread_mutex_lock(&k->out_lock);
+        if (k->out_running)
+        {
+            pthread_mutex_unlock(&k->out_lock);
+            return 0;
+        }
+        k->out_stop = 0;
+        k->out_staged = k->out_written = 0;
+        if (pthread_create(&k->out_thread, NULL, OutputThread, k) != 0)
+        {
+            pthread_mutex_unlock(&k->out_lock);
+            return K8055_ERROR;
+        }
+        k->out_running = 1;
+        pthread_mutex_unlock(&k->out_lock);
+        LockIO(k);
+        k->out_async = 1;
+        UnlockIO(k);
+        return 0;
+    }
+
+    LockIO(k);
+    k->out_async = 0;
+    UnlockIO(k);
+    pthread_mutex_lock(&k->out_lock);
+    if (!k->out_running)
+    {
+        pthread_mutex_unlock(&k->out_lock);
+        return 0;
+    }
+    k->out_stop = 1;
+    k->out_running = 0;
+    pthread_cond_broadcast(&k->out_cond);
+    pthread_mutex_unlock(&k->out_lock);
+    pthread_join(k->out_thread, NULL);
+    return 0;
+}
+
+int GetAsyncOutput(k8055_dev *k)
+{
+    int running;
+
+    pthread_mutex_lock(&k->out_lock);
+    running = k->out_running;
+    pthread_mutex_unlock(&k->out_lock);
+    return running;
+}
+
+/* Wait up to timeout_ms (forever if < 0) until every output change staged
+   before the call has been sent. Returns 0 at once without async output,
+   K8055_ERROR on a timeout or when cancelled (cancel may be NULL). */
+int FlushOutputs(k8055_dev *k, long timeout_ms, k8055_cancel *cancel)
 {
+    struct timespec deadline;
+    unsigned long target;
+    int rval = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    AddMicroseconds(&deadline, timeout_ms > 0 ? timeout_ms * 1000UL : 0);
+    pthread_mutex_lock(&k->out_lock);
+    target = k->out_staged;
+    while ((long)(target - k->out_written) > 0 && rval != ETIMEDOUT && !WaitCancelled(k, cancel))
+    {
+        if (timeout_ms < 0)
+            pthread_cond_wait(&k->out_cond, &k->out_lock);
+        else
+            rval = pthread_cond_timedwait(&k->out_cond, &k->out_lock, &deadline);
+    }
+    rval = (long)(target - k->out_written) > 0 ? K8055_ERROR : 0;
+    pthread_mutex_unlock(&k->out_lock);
+    return rval;
+}
+
+/* Stage digital and analog output changes instead of sending them. Batches
+   nest; the outermost EndOutputBatch() sends all staged changes in a single
+   command 5 packet, or nothing if none were made. */
+void BeginOutputBatch(k8055_dev *k)
+{
+    LockIO(k);
+    k->batch_depth++;
+    UnlockIO(k);
+}
+
+int EndOutputBatch(k8055_dev *k)
+{
+    int rval = 0;
+
+    LockIO(k);
+    if (k->batch_depth > 0 && --k->batch_depth == 0 && k->batch_dirty)
+    {
+        k->batch_dirty = 0;
+        rval = WriteK8055Data(k, CMD_SET_ANALOG_DIGITAL);
+    }
+    UnlockIO(k);
+    return rval;
+}
+
+int ResetCounter(k8055_dev *k, long counterno)
+{
+    int rval;
+
     if (counterno == 1 || counterno == 2)
     {
-        data_out[0] = 0x02 + (unsigned char)counterno;  /* counter selection */
-        data_out[3 + counterno] = 0x00;
-        return WriteK8055Data(data_out[0]);
+        LockIO(k);
+        pthread_mutex_lock(&k->sample_lock);
+        k->counters[counterno - 1].reset_pending = 1;
+        pthread_mutex_unlock(&k->sample_lock);
+        k->data_out[0] = 0x02 + (unsigned char)counterno;  /* counter selection */
+        k->data_out[3 + counterno] = 0x00;
+        rval = WriteK8055Data(k, k->data_out[0]);
+        UnlockIO(k);
+        return rval;
     }
     else
         return K8055_ERROR;
 }
 
-long ReadCounter(long counterno)
+long ReadCounter(k8055_dev *k, long counterno)
 {
+    k8055_sample sample;
+
     if (counterno == 1 || counterno == 2)
     {
-        if (ReadK8055Data() == 0)
+        if (FetchInput(k, &sample) == 0)
         {
             if (counterno == 2)
-                return *((short int *)(&data_in[COUNTER_2_OFFSET]));
+                return DecodeCounter(sample.packet, COUNTER_2_OFFSET);
             else
-                return *((short int *)(&data_in[COUNTER_1_OFFSET]));
+                return DecodeCounter(sample.packet, COUNTER_1_OFFSET);
         }
         else
             return K8055_ERROR;
@@ -464,13 +2335,65 @@ long ReadCounter(long counterno)
         return K8055_ERROR;
 }
 
-int SetCounterDebounceTime(long counterno, long debouncetime)
+/* The counter as a 64-bit total that keeps counting past the board's 16-bit
+   wrap. Reads the board like ReadCounter() (or takes the acquisition
+   thread's latest packet); wraps are only caught if packets arrive at least
+   once per 65536 pulses. */
+int ReadCounterTotal(k8055_dev *k, long counterno, uint64_t *total)
+{
+    k8055_sample sample;
+
+    if ((counterno != 1 && counterno != 2) || FetchInput(k, &sample) != 0)
+        return K8055_ERROR;
+    pthread_mutex_lock(&k->sample_lock);
+    *total = k->counters[counterno - 1].total;
+    pthread_mutex_unlock(&k->sample_lock);
+    return 0;
+}
+
+/* Pulses per second over the last window_s seconds (at most 60) of received
+   packets, from the counter history; no USB transfer. Returns 0 until two
+   packets with different times have been seen, K8055_ERROR for a bad
+   counter number. */
+double ReadCounterRate(k8055_dev *k, long counterno, double window_s)
+{
+    counter_track *c;
+    uint64_t slots, newest_time, newest_total;
+    double rate = 0;
+
+    if (counterno != 1 && counterno != 2)
+        return K8055_ERROR;
+    c = &k->counters[counterno - 1];
+    slots = window_s > 0 ? (uint64_t)(window_s * 1e9 / RATE_RESOLUTION + 0.5) : 1;
+    if (slots < 1)
+        slots = 1;
+    if (slots > RATE_SLOTS - 1)
+        slots = RATE_SLOTS - 1;
+
+    pthread_mutex_lock(&k->sample_lock);
+    if (c->history_valid)
+    {
+        if (slots > c->last_slot - c->first_slot)
+            slots = c->last_slot - c->first_slot;
+        newest_time = c->history[c->last_slot % RATE_SLOTS].time;
+        newest_total = c->history[c->last_slot % RATE_SLOTS].total;
+        if (slots > 0 && newest_time > c->history[(c->last_slot - slots) % RATE_SLOTS].time)
+            rate = (newest_total - c->history[(c->last_slot - slots) % RATE_SLOTS].total) * 1e9 /
+                (newest_time - c->history[(c->last_slot - slots) % RATE_SLOTS].time);
+    }
+    pthread_mutex_unlock(&k->sample_lock);
+    return rate;
+}
+
+int SetCounterDebounceTime(k8055_dev *k, long counterno, long debouncetime)
 {
     float value;
+    int rval;
 
     if (counterno == 1 || counterno == 2)
     {
-        data_out[0] = (unsigned char)counterno;
+        LockIO(k);
+        k->data_out[0] = (unsigned char)counterno;
         /* the velleman k8055 use a exponetial formula to split up the
            debouncetime 0-7450 over value 1-255. I've tested every value and
            found that the formula dbt=0,338*value^1,8017 is closest to
@@ -483,11 +2406,13 @@ int SetCounterDebounceTime(long counterno, long debouncetime)
         value = sqrtf(debouncetime / 0.115);
         if (value > ((int)value + 0.49999999))  /* simple round() function) */
             value += 1;
-        data_out[5 + counterno] = (unsigned char)value;
+        k->data_out[5 + counterno] = (unsigned char)value;
         if (DEBUG)
             fprintf(stderr, "Debouncetime%d value for k8055:%d\n",
-                    (int)counterno, data_out[5 + counterno]);
-        return WriteK8055Data(data_out[0]);
+                    (int)counterno, k->data_out[5 + counterno]);
+        rval = WriteK8055Data(k, k->data_out[0]);
+        UnlockIO(k);
+        return rval;
     }
     else
         return K8055_ERROR;
@@ -1,12 +1,16 @@
 #include "ruby.h"
+#include "ruby/thread.h"
 #include "k8055.h"
 
 #include <stdlib.h> /* for malloc(), free(), and NULL */
 #include <string.h>
 #include <stdio.h>
-#include <usb.h>
 #include <assert.h>
 #include <sys/time.h>
+#include <math.h>
+#ifdef HAVE_RB_IO_BUFFER_GET_BYTES_FOR_WRITING
+#include "ruby/io/buffer.h"
+#endif
 
 #define STR_BUFF 256
 #define false 0
@@ -18,332 +22,1643 @@ int delay = 0;
 
 // Defining a space for information and references about the module to be stored internally
 VALUE RubyK8055 = Qnil;
+// USB::RubyK8055::Snapshot, the frozen struct returned by #snapshot
+static VALUE cSnapshot = Qnil;
+
+// USB::RubyK8055::Error, raised when the board can't be opened or fails a
+// call, and its subclass NotConnectedError
+static VALUE eK8055Error = Qnil, eNotConnected = Qnil;
+
+static ID id_call, id_confirm, id_no_confirm, id_deferred, id_rising, id_falling;
+static ID id_count, id_interval_us, id_channels, id_start;
+// #acquire columns, in the order of ACQUIRE_COLUMNS
+static ID id_digital, id_analog1, id_analog2, id_counter1, id_counter2;
+// hash keys of #acquire, #analog_stats and #stats
+static ID id_timestamps, id_jitter, id_next, id_samples, id_mean, id_stddev, id_median;
+static ID id_min, id_max, id_smoothed, id_missed, id_read, id_write, id_transfers, id_retries;
+static ID id_timeouts, id_short_packets, id_errors, id_failures, id_skipped, id_time, id_histogram;
+static ID id_alive_p, id_join, id_iv_k8055;
 
 // Prototype for the initialization method - Ruby calls this, not you
-void Init_rubyk8055();
+void Init_rubyk8055(void);
+
+// ------------------- Board context ---------------------
+
+// Each RubyK8055 instance owns its own libk8055 context, so several boards
+// can be driven from one process.
+typedef struct {
+    k8055_dev *dev;
+    int connected;          // dev has an open board, at board_address
+    long board_address;
+    VALUE lock;             // Mutex serialising this object's calls into libk8055
+    VALUE batch_thread;     // Thread holding lock for a #batch block, or nil
+    VALUE on_write_error;   // block given to #on_write_error, or nil
+    VALUE listeners;        // #on_change/#on_edge blocks: channel (0 = any) => [blocks]
+    VALUE event_thread;     // Thread delivering edge events, or nil
+    int events_acquire;     // the event thread started acquisition itself
+} rubyk8055;
+
+static void rubyk8055_mark(void *ptr) {
+    rb_gc_mark(((rubyk8055 *)ptr)->lock);
+    rb_gc_mark(((rubyk8055 *)ptr)->batch_thread);
+    rb_gc_mark(((rubyk8055 *)ptr)->on_write_error);
+    rb_gc_mark(((rubyk8055 *)ptr)->listeners);
+    rb_gc_mark(((rubyk8055 *)ptr)->event_thread);
+}
+
+static void rubyk8055_free(void *ptr) {
+    rubyk8055 *r = ptr;
+    // Also closes the board if the object is collected while still connected.
+    // That joins libk8055's threads and can wait for a USB transfer, so the
+    // type is not RUBY_TYPED_FREE_IMMEDIATELY and Ruby defers this until after
+    // the sweep.
+    FreeDevice(r->dev);
+    xfree(r);
+}
+
+static size_t rubyk8055_memsize(const void *ptr) {
+    return sizeof(rubyk8055);
+}
+
+static const rb_data_type_t rubyk8055_type = {
+    "USB::RubyK8055",
+    { rubyk8055_mark, rubyk8055_free, rubyk8055_memsize },
+    0, 0, 0
+};
+
+static VALUE rubyk8055_alloc(VALUE klass) {
+    rubyk8055 *r;
+    VALUE obj = TypedData_Make_Struct(klass, rubyk8055, &rubyk8055_type, r);
+    r->lock = rb_mutex_new();
+    r->batch_thread = Qnil;
+    r->on_write_error = Qnil;
+    r->listeners = rb_hash_new();
+    r->event_thread = Qnil;
+    r->dev = NewDevice();
+    if (r->dev == NULL)
+        rb_raise(rb_eNoMemError, "could not allocate K8055 context");
+    return obj;
+}
+
+static rubyk8055 *get_wrapper(VALUE self) {
+    return rb_check_typeddata(self, &rubyk8055_type);
+}
+
+static k8055_dev *get_device(VALUE self) {
+    return get_wrapper(self)->dev;
+}
+
+// The context of a connected board; raises NotConnectedError otherwise.
+static rubyk8055 *connected_wrapper(VALUE self) {
+    rubyk8055 *r = get_wrapper(self);
+
+    if (!r->connected)
+        rb_raise(eNotConnected, "not connected to K8055");
+    return r;
+}
+
+NORETURN(static void device_error(const rubyk8055 *r));
+
+static void device_error(const rubyk8055 *r) {
+    rb_raise(eK8055Error, "K8055 with address %ld returned an error", r->board_address);
+}
+
+// Passes a libk8055 result through, raising Error for its -1.
+static long checked(const rubyk8055 *r, long result) {
+    if (result == -1)
+        device_error(r);
+    return result;
+}
+
+// ------------------- Calls without the GVL ---------------------
+
+// USB transfers block for up to 3 x 20ms per packet, so every call that may
+// touch the bus runs without the GVL. The object's lock keeps two Ruby threads
+// from interleaving packets on one board; Thread#kill or a timeout interrupts
+// the call through InterruptDevice().
+// Snapshot waits, #acquire and #flush run without the lock instead (libk8055
+// serialises any transfer they make), and are cut short through their own
+// cancel flag, so they neither clear nor see the device-wide interrupt of
+// another thread's call.
+
+struct blocking_call {
+    k8055_dev *k;
+    long arg1, arg2;
+    uint64_t time;
+    void *out;
+    long result;
+    void *(*func)(void *);
+    k8055_cancel cancel;    // for unlocked_call
+};
+
+static void unblock_device(void *k) {
+    InterruptDevice((k8055_dev *)k);
+}
+
+static VALUE call_without_gvl(VALUE arg) {
+    struct blocking_call *call = (struct blocking_call *)arg;
+
+    rb_thread_call_without_gvl(call->func, call, unblock_device, call->k);
+    return Qnil;
+}
+
+static VALUE clear_interrupt(VALUE arg) {
+    ClearInterrupt(((struct blocking_call *)arg)->k);
+    return Qnil;
+}
+
+// Runs with the object's lock held. The interrupt is cleared even when a
+// pending Thread#raise or #kill unwinds out of the call.
+static VALUE locked_call(VALUE arg) {
+    struct blocking_call *call = (struct blocking_call *)arg;
+
+    ClearInterrupt(call->k);
+    return rb_ensure(call_without_gvl, arg, clear_interrupt, arg);
+}
+
+static void cancel_call(void *arg) {
+    struct blocking_call *call = arg;
+    CancelWait(call->k, &call->cancel);
+}
+
+static void unlocked_call(struct blocking_call *call) {
+    atomic_init(&call->cancel.cancelled, 0);
+    rb_thread_call_without_gvl(call->func, call, cancel_call, call);
+}
+
+static long blocking_call(rubyk8055 *r, void *(*func)(void *), long arg1, long arg2, void *out) {
+    struct blocking_call call = { r->dev, arg1, arg2, 0, out, -1, func };
+    unsigned long errors = GetWriteErrors(r->dev);
+
+    // a #batch block already holds the lock for its own thread
+    if (r->batch_thread == rb_thread_current())
+        locked_call((VALUE)&call);
+    else
+        rb_mutex_synchronize(r->lock, locked_call, (VALUE)&call);
+    // without read back, failed writes are only counted; report them here,
+    // back on the Ruby thread
+    if (!NIL_P(r->on_write_error) && GetWriteErrors(r->dev) != errors)
+        rb_funcall(r->on_write_error, id_call, 1, ULONG2NUM(GetWriteErrors(r->dev)));
+    return call.result;
+}
+
+// Input reads served from the acquisition cache never touch USB, so they run
+// directly instead of paying for a GVL release.
+static long read_call(rubyk8055 *r, void *(*func)(void *), long arg1, long arg2, void *out) {
+    struct blocking_call call = { r->dev, arg1, arg2, 0, out, -1, func };
+
+    if (!IsAcquiring(call.k))
+        return blocking_call(r, func, arg1, arg2, out);
+    func(&call);
+    return call.result;
+}
+
+static void *nogvl_open(void *p) {
+    struct blocking_call *c = p;
+    c->result = OpenDeviceWith(c->k, c->arg1, c->out);
+    return NULL;
+}
+
+static void *nogvl_close(void *p) {
+    struct blocking_call *c = p;
+    c->result = CloseDevice(c->k);
+    return NULL;
+}
+
+static void *nogvl_read_analog(void *p) {
+    struct blocking_call *c = p;
+    c->result = ReadAnalogChannel(c->k, c->arg1);
+    return NULL;
+}
+
+static void *nogvl_output_analog(void *p) {
+    struct blocking_call *c = p;
+    c->result = OutputAnalogChannel(c->k, c->arg1, c->arg2);
+    return NULL;
+}
+
+static void *nogvl_read_digital(void *p) {
+    struct blocking_call *c = p;
+    c->result = ReadDigitalChannel(c->k, c->arg1);
+    return NULL;
+}
+
+static void *nogvl_set_digital(void *p) {
+    struct blocking_call *c = p;
+    if (c->arg2)
+        c->result = SetDigitalChannel(c->k, c->arg1);
+    else
+        c->result = ClearDigitalChannel(c->k, c->arg1);
+    return NULL;
+}
+
+static void *nogvl_write_all_digital(void *p) {
+    struct blocking_call *c = p;
+    c->result = WriteAllDigital(c->k, c->arg1);
+    return NULL;
+}
+
+static void *nogvl_set_all_digital(void *p) {
+    struct blocking_call *c = p;
+    c->result = SetAllDigital(c->k);
+    return NULL;
+}
+
+static void *nogvl_clear_all_digital(void *p) {
+    struct blocking_call *c = p;
+    c->result = ClearAllDigital(c->k);
+    return NULL;
+}
+
+static void *nogvl_set_all_analog(void *p) {
+    struct blocking_call *c = p;
+    c->result = SetAllAnalog(c->k);
+    return NULL;
+}
+
+static void *nogvl_clear_all_analog(void *p) {
+    struct blocking_call *c = p;
+    c->result = ClearAllAnalog(c->k);
+    return NULL;
+}
+
+static void *nogvl_counter_total(void *p) {
+    struct blocking_call *c = p;
+    c->result = ReadCounterTotal(c->k, c->arg1, c->out);
+    return NULL;
+}
+
+static void *nogvl_read_counter(void *p) {
+    struct blocking_call *c = p;
+    ReadCounter(c->k, c->arg1);
+    c->result = ReadCounter(c->k, c->arg1);    // Reads twice, to get around buffering error
+    return NULL;
+}
+
+static void *nogvl_reset_counter(void *p) {
+    struct blocking_call *c = p;
+    c->result = ResetCounter(c->k, c->arg1);
+    return NULL;
+}
+
+static void *nogvl_set_debounce(void *p) {
+    struct blocking_call *c = p;
+    c->result = SetCounterDebounceTime(c->k, c->arg1, c->arg2);
+    return NULL;
+}
+
+static void *nogvl_end_batch(void *p) {
+    struct blocking_call *c = p;
+    c->result = EndOutputBatch(c->k);
+    return NULL;
+}
+
+static void *nogvl_set_async_output(void *p) {
+    struct blocking_call *c = p;
+    c->result = SetAsyncOutput(c->k, (int)c->arg1);
+    return NULL;
+}
+
+static void *nogvl_flush_outputs(void *p) {
+    struct blocking_call *c = p;
+    c->result = FlushOutputs(c->k, c->arg1, &c->cancel);
+    return NULL;
+}
+
+static void *nogvl_read_sample(void *p) {
+    struct blocking_call *c = p;
+    c->result = ReadSample(c->k, c->out);
+    return NULL;
+}
+
+static void *nogvl_wait_sample(void *p) {
+    struct blocking_call *c = p;
+    c->result = WaitSampleNewer(c->k, c->out, c->time, c->arg1, &c->cancel);
+    return NULL;
+}
+
+struct acquire_buffers {
+    k8055_sample *samples;
+    k8055_acquire_stats stats;
+};
+
+static void *nogvl_acquire(void *p) {
+    struct blocking_call *c = p;
+    struct acquire_buffers *b = c->out;
+    c->result = AcquireSamples(c->k, b->samples, c->arg1, c->arg2, c->time, &b->stats, &c->cancel);
+    return NULL;
+}
+
+static void *nogvl_stop_acquisition(void *p) {
+    struct blocking_call *c = p;
+    c->result = StopAcquisition(c->k);
+    return NULL;
+}
+
+static void *nogvl_play_sequence(void *p) {
+    struct blocking_call *c = p;
+    c->result = PlaySequence(c->k, c->out, c->arg1, c->arg2);
+    return NULL;
+}
+
+static void *nogvl_stop_sequence(void *p) {
+    struct blocking_call *c = p;
+    c->result = StopSequence(c->k);
+    return NULL;
+}
+
+static void *nogvl_start_capture(void *p) {
+    struct blocking_call *c = p;
+    c->result = StartCapture(c->k, c->out, c->arg1);
+    return NULL;
+}
+
+static void *nogvl_stop_capture(void *p) {
+    struct blocking_call *c = p;
+    c->result = StopCapture(c->k);
+    return NULL;
+}
+
+static void *nogvl_sim_configure(void *p) {
+    struct blocking_call *c = p;
+    c->result = ConfigureSimulator(c->k, c->arg1, c->arg2, *(double *)c->out);
+    return NULL;
+}
+
+static void *nogvl_sim_inputs(void *p) {
+    struct blocking_call *c = p;
+    long *analog = c->out;
+    c->result = SimulateInputs(c->k, c->arg1, analog[0], analog[1]);
+    return NULL;
+}
+
+static void *nogvl_sim_pulse_counter(void *p) {
+    struct blocking_call *c = p;
+    c->result = SimulateCounterPulses(c->k, c->arg1, c->arg2);
+    return NULL;
+}
+
+static void *nogvl_sim_unplug(void *p) {
+    struct blocking_call *c = p;
+    c->result = SimulateUnplug(c->k, c->arg1);
+    return NULL;
+}
+
+static void *nogvl_set_auto_reconnect(void *p) {
+    struct blocking_call *c = p;
+    SetAutoReconnect(c->k, c->arg1);
+    c->result = 0;
+    return NULL;
+}
+
+static void *nogvl_sim_outputs(void *p) {
+    struct blocking_call *c = p;
+    long *outputs = c->out;
+    c->result = SimulatedOutputs(c->k, &outputs[0], &outputs[1], &outputs[2]);
+    return NULL;
+}
 
 // ------------------- Validations ---------------------
 
-static int check_connection(VALUE self) {
-    if (rb_iv_get(self, "@connected") == Qtrue) {
-        return true;
-    } else {
-        printf("Not connected to K8055!\n");
-        return false;
-    }
+// Converts an argument, raising ArgumentError when it is outside min..max.
+static long in_range(VALUE value, long min, long max, const char *what) {
+    long v = NUM2LONG(value);
+
+    if (v < min || v > max)
+        rb_raise(rb_eArgError, "invalid %s %ld (must be %ld-%ld)", what, v, min, max);
+    return v;
 }
 
-static int valid_analog_channel(long channel) {
-    if (channel == 1 || channel == 2) {
-        return true;
-    } else {
-        printf("Invalid analog channel! Must be 1 or 2 : (%ld)\n", channel);
-        return false;
-    }
+static long analog_channel(VALUE channel) {
+    return in_range(channel, 1, 2, "analog channel");
 }
 
-static int valid_analog_value(long value) {
-    if (value >= 0 && value <= 255) {
-        return true;
-    } else {
-        printf("Invalid analog value! Must be between 0-255 : (%ld)\n", value);
-        return false;
-    }
+static long analog_value(VALUE value) {
+    return in_range(value, 0, 255, "analog value");
 }
 
-static int valid_digital_output_channel(long channel) {
-    if (channel >= 1 && channel <= 8) {
-        return true;
-    } else {
-        printf("Invalid digital channel! Must be between 1-8 : (%ld)\n", channel);
-        return false;
-    }
+static long digital_output_channel(VALUE channel) {
+    return in_range(channel, 1, 8, "digital output channel");
 }
 
-static int valid_digital_input_channel(long channel) {
-    if (channel >= 1 && channel <= 5) {
-        return true;
-    } else {
-        printf("Invalid digital channel! Must be between 1-5 : (%ld)\n", channel);
-        return false;
-    }
+static long digital_input_channel(VALUE channel) {
+    return in_range(channel, 1, 5, "digital input channel");
 }
 
-static int valid_counter(long counter) {
-    if (counter == 1 || counter == 2) {
-        return true;
-    } else {
-        printf("Invalid counter! Must be 1 or 2 : (%ld)\n", counter);
-        return false;
-    }
+static long counter_number(VALUE counter) {
+    return in_range(counter, 1, 2, "counter");
 }
 
 // ----------------------------- K8055 Methods ---------------------------
 
+// connect(address = board_address, transport = nil). Raises Error when the
+// board can't be opened or this object is already connected.
 static VALUE method_connect(int argc, VALUE *argv, VALUE self) {
-    long board_address = NUM2INT(rb_iv_get(self, "@board_address"));
-    // if no args given, connect to board '0'
-    if (argc > 0) {
-        // Converts ruby fixnum to C data
-        board_address = NUM2INT(argv[0]);
-    }
-    if (rb_iv_get(self, "@connected") == Qfalse) {
-        if (OpenDevice(board_address) != -1) {
-            printf("Connected to K8055 with address: %ld\n", board_address);
-            rb_iv_set(self, "@connected", Qtrue);
-            // Sets the board address to the connected board.
-            rb_iv_set(self, "@board_address", INT2NUM(board_address));
-            return Qtrue;
-        } else {
-            printf("Could not connect to K8055 with address: %ld\n", board_address);
-            rb_iv_set(self, "@connected", Qfalse);
-        }
-    } else {
-        printf("Already connected to K8055!\n");
+    rubyk8055 *r = get_wrapper(self);
+    long board_address = r->board_address;
+    VALUE address, transport;
+    const char *transport_name = NULL;
+
+    rb_scan_args(argc, argv, "02", &address, &transport);
+    // if no args given, connect to the last board (or board '0')
+    if (!NIL_P(address))
+        board_address = in_range(address, 0, 3, "board address");
+    // transport name (:libusb1, :libusb, ...), nil picks the first one that works
+    if (!NIL_P(transport)) {
+        transport = rb_obj_as_string(transport);
+        transport_name = StringValueCStr(transport);
     }
-    return Qfalse;
+    if (r->connected)
+        rb_raise(eK8055Error, "already connected to K8055 with address %ld", r->board_address);
+    if (blocking_call(r, nogvl_open, board_address, 0, (void *)transport_name) == -1)
+        rb_raise(eK8055Error, "could not connect to K8055 with address %ld", board_address);
+    RB_GC_GUARD(transport);
+    r->connected = true;
+    r->board_address = board_address;
+    return Qtrue;
+}
+
+// When true, a board that drops off the bus or is reset gets reopened on the
+// next call (with backoff, so a missing board doesn't stall every call) and
+// its outputs are restored. Calls made while it is away raise Error.
+static VALUE method_set_auto_reconnect(VALUE self, VALUE enable) {
+    blocking_call(get_wrapper(self), nogvl_set_auto_reconnect, RTEST(enable), 0, NULL);
+    return enable;
 }
 
+static VALUE method_auto_reconnect(VALUE self) {
+    return GetAutoReconnect(get_device(self)) ? Qtrue : Qfalse;
+}
+
+static VALUE method_reconnects(VALUE self) {
+    return ULONG2NUM(GetReconnects(get_device(self)));
+}
+
+static VALUE method_stop_events(VALUE self);
+
+// False, without raising, when not connected. Closing the board stops the
+// acquisition thread the edge events run on, so they are stopped too.
 static VALUE method_disconnect(VALUE self) {
-    if (check_connection(self)) {
-        if (CloseDevice() != -1) {
-            printf("Closed connection to K8055.\n");
-            rb_iv_set(self, "@connected", Qfalse);
-            return Qtrue;
-        } else {
-            printf("Could not close connection to K8055.\n");
-        }
+    rubyk8055 *r = get_wrapper(self);
+
+    if (!r->connected)
+        return Qfalse;
+    method_stop_events(self);
+    checked(r, blocking_call(r, nogvl_close, 0, 0, NULL));
+    r->connected = false;
+    return Qtrue;
+}
+
+static VALUE method_connected(VALUE self) {
+    return get_wrapper(self)->connected ? Qtrue : Qfalse;
+}
+
+static VALUE method_board_address(VALUE self) {
+    return LONG2FIX(get_wrapper(self)->board_address);
+}
+
+static VALUE method_get_analog(VALUE self, VALUE channel) {
+    rubyk8055 *r = connected_wrapper(self);
+    return LONG2FIX(checked(r, read_call(r, nogvl_read_analog, analog_channel(channel), 0, NULL)));
+}
+
+static VALUE set_analog(VALUE self, VALUE channel, long value) {
+    rubyk8055 *r = connected_wrapper(self);
+    checked(r, blocking_call(r, nogvl_output_analog, analog_channel(channel), value, NULL));
+    return Qtrue;
+}
+
+static VALUE method_set_analog(VALUE self, VALUE channel, VALUE value) {
+    return set_analog(self, channel, analog_value(value));
+}
+
+// analog_filter(channel, window, alpha=0.2): keeps the last window values
+// (up to 1024, 0 turns it off) of an analog input and an exponential moving
+// average, updated in native code from every packet received.
+static VALUE method_analog_filter(int argc, VALUE *argv, VALUE self) {
+    VALUE channel, window, alpha;
+
+    rb_scan_args(argc, argv, "21", &channel, &window, &alpha);
+    if (SetAnalogFilter(get_device(self), analog_channel(channel), NUM2ULONG(window),
+                        NIL_P(alpha) ? 0.2 : NUM2DBL(alpha)) == -1)
+        rb_raise(rb_eArgError, "window must be 0-%d and alpha in (0, 1]", K8055_FILTER_MAX_WINDOW);
+    return Qtrue;
+}
+
+// { :samples, :mean, :stddev, :median, :min, :max, :smoothed } of the
+// filter's window as of the last packet, without a USB transfer. nil when
+// the channel has no filter or no packet arrived since it was set.
+static VALUE method_analog_stats(VALUE self, VALUE channel) {
+    k8055_analog_stats stats;
+    VALUE hash;
+
+    if (ReadAnalogFilter(get_device(self), analog_channel(channel), &stats) == -1 || stats.samples == 0)
+        return Qnil;
+    hash = rb_hash_new();
+    rb_hash_aset(hash, ID2SYM(id_samples), ULONG2NUM(stats.samples));
+    rb_hash_aset(hash, ID2SYM(id_mean), DBL2NUM(stats.mean));
+    rb_hash_aset(hash, ID2SYM(id_stddev), DBL2NUM(stats.stddev));
+    rb_hash_aset(hash, ID2SYM(id_median), DBL2NUM(stats.median));
+    rb_hash_aset(hash, ID2SYM(id_min), LONG2NUM(stats.min));
+    rb_hash_aset(hash, ID2SYM(id_max), LONG2NUM(stats.max));
+    rb_hash_aset(hash, ID2SYM(id_smoothed), DBL2NUM(stats.smoothed));
+    return hash;
+}
+
+static VALUE method_set_analog_max(VALUE self, VALUE channel) {
+    return set_analog(self, channel, 255);
+}
+
+static VALUE method_set_analog_min(VALUE self, VALUE channel) {
+    return set_analog(self, channel, 0);
+}
+
+static VALUE method_get_digital(VALUE self, VALUE channel) {
+    rubyk8055 *r = connected_wrapper(self);
+    return LONG2FIX(checked(r, read_call(r, nogvl_read_digital, digital_input_channel(channel), 0, NULL)));
+}
+
+// set_digital_debounce(channel, ms, samples=0): a digital input change is
+// only seen once it has lasted ms milliseconds and samples packets. Applied
+// in native code to every packet, so get_digital, all_inputs, snapshot and
+// the edge events never see shorter pulses.
+static VALUE method_set_digital_debounce(int argc, VALUE *argv, VALUE self) {
+    VALUE channel, ms, samples;
+
+    rb_scan_args(argc, argv, "21", &channel, &ms, &samples);
+    if (SetDigitalDebounce(get_device(self), digital_input_channel(channel), (long)(NUM2DBL(ms) * 1000),
+                           NIL_P(samples) ? 0 : NUM2ULONG(samples)) == -1)
+        rb_raise(rb_eArgError, "debounce time must not be negative");
+    return Qtrue;
+}
+
+// [ms, samples] of an input's software debounce
+static VALUE method_digital_debounce(VALUE self, VALUE channel) {
+    long time_us;
+    unsigned long samples;
+
+    GetDigitalDebounce(get_device(self), digital_input_channel(channel), &time_us, &samples);
+    return rb_assoc_new(DBL2NUM(time_us / 1000.0), ULONG2NUM(samples));
+}
+
+static VALUE method_digital_glitches(VALUE self) {
+    return ULONG2NUM(GetDigitalGlitches(get_device(self)));
+}
+
+static VALUE set_digital(VALUE self, VALUE channel, int value) {
+    rubyk8055 *r = connected_wrapper(self);
+    checked(r, blocking_call(r, nogvl_set_digital, digital_output_channel(channel), value, NULL));
+    return Qtrue;
+}
+
+static VALUE method_set_digital(VALUE self, VALUE channel, VALUE value) {
+    // 0 is off as well as false and nil
+    return set_digital(self, channel, RTEST(value) && value != INT2FIX(0));
+}
+
+static VALUE method_digital_on(VALUE self, VALUE channel) {
+    return set_digital(self, channel, true);
+}
+
+static VALUE method_digital_off(VALUE self, VALUE channel) {
+    return set_digital(self, channel, false);
+}
+
+static VALUE method_write_all_digital(VALUE self, VALUE value) {
+    rubyk8055 *r = connected_wrapper(self);
+    checked(r, blocking_call(r, nogvl_write_all_digital, NUM2LONG(value), 0, NULL));
+    return Qtrue;
+}
+
+// The outputs as last set from this object, read from the library's shadow
+// of them (the board can't report its outputs): [out1, ..., out8] as 0/1.
+static VALUE method_digital_outputs(VALUE self) {
+    long digital, analog1, analog2;
+
+    GetOutputs(get_device(self), &digital, &analog1, &analog2);
+    return rb_ary_new_from_args(8,
+                                INT2FIX(digital & 0x01), INT2FIX((digital >> 1) & 0x01),
+                                INT2FIX((digital >> 2) & 0x01), INT2FIX((digital >> 3) & 0x01),
+                                INT2FIX((digital >> 4) & 0x01), INT2FIX((digital >> 5) & 0x01),
+                                INT2FIX((digital >> 6) & 0x01), INT2FIX((digital >> 7) & 0x01));
+}
+
+// [analog1, analog2] as last set from this object
+static VALUE method_analog_outputs(VALUE self) {
+    long digital, analog1, analog2;
+
+    GetOutputs(get_device(self), &digital, &analog1, &analog2);
+    return rb_assoc_new(INT2FIX(analog1), INT2FIX(analog2));
+}
+
+// Output writes that were skipped because the board already had those values
+static VALUE method_writes_skipped(VALUE self) {
+    return ULONG2NUM(GetWritesSkipped(get_device(self)));
+}
+
+// The methods without arguments that only report success
+static VALUE simple_call(VALUE self, void *(*func)(void *)) {
+    rubyk8055 *r = connected_wrapper(self);
+    checked(r, blocking_call(r, func, 0, 0, NULL));
+    return Qtrue;
+}
+
+static VALUE method_set_all_digital(VALUE self) {
+    return simple_call(self, nogvl_set_all_digital);
+}
+
+static VALUE method_clear_all_digital(VALUE self) {
+    return simple_call(self, nogvl_clear_all_digital);
+}
+
+static VALUE method_set_all_analog(VALUE self) {
+    return simple_call(self, nogvl_set_all_analog);
+}
+
+static VALUE method_clear_all_analog(VALUE self) {
+    return simple_call(self, nogvl_clear_all_analog);
+}
+
+static VALUE method_read_counter(VALUE self, VALUE counter) {
+    rubyk8055 *r = connected_wrapper(self);
+    return LONG2FIX(checked(r, read_call(r, nogvl_read_counter, counter_number(counter), 0, NULL)));
+}
+
+static VALUE method_reset_counter(VALUE self, VALUE counter) {
+    rubyk8055 *r = connected_wrapper(self);
+    checked(r, blocking_call(r, nogvl_reset_counter, counter_number(counter), 0, NULL));
+    return Qtrue;
+}
+
+static VALUE method_set_debounce(VALUE self, VALUE counter, VALUE time) {
+    rubyk8055 *r = connected_wrapper(self);
+    checked(r, blocking_call(r, nogvl_set_debounce, counter_number(counter), NUM2LONG(time), NULL));
+    return Qtrue;
+}
+
+// The counter as a 64-bit total that doesn't wrap at 65536 like #read_counter.
+// Every packet received updates it, so with the acquisition thread running no
+// wrap is missed.
+static VALUE method_counter_total(VALUE self, VALUE counter) {
+    rubyk8055 *r = connected_wrapper(self);
+    uint64_t total;
+
+    checked(r, read_call(r, nogvl_counter_total, counter_number(counter), 0, &total));
+    return ULL2NUM(total);
+}
+
+// Pulses per second over the last window seconds (up to 60) of received
+// packets. Computed from history kept in native code, no USB transfer.
+static VALUE method_counter_rate(int argc, VALUE *argv, VALUE self) {
+    VALUE counter, window;
+
+    rb_scan_args(argc, argv, "11", &counter, &window);
+    return DBL2NUM(ReadCounterRate(get_device(self), counter_number(counter),
+                                   NIL_P(window) ? 1.0 : NUM2DBL(window)));
+}
+
+// Converts between libk8055's CLOCK_MONOTONIC nanoseconds and the Float seconds
+// returned by Process.clock_gettime(Process::CLOCK_MONOTONIC).
+static VALUE timestamp_to_rb(uint64_t timestamp) {
+    return DBL2NUM(timestamp / 1e9);
+}
+
+static uint64_t timestamp_from_rb(VALUE seconds) {
+    double t = NUM2DBL(seconds);
+    return t > 0 ? (uint64_t)(t * 1e9) : 0;
+}
+
+static VALUE sample_to_snapshot(const k8055_sample *sample) {
+    long digital, analog1, analog2, counter1, counter2;
+    VALUE snapshot;
+
+    DecodeValues(sample->packet, &digital, &analog1, &analog2, &counter1, &counter2);
+    digital = sample->digital;
+    snapshot = rb_struct_new(cSnapshot,
+                             INT2NUM(digital & 0x01),
+                             INT2NUM((digital >> 1) & 0x01),
+                             INT2NUM((digital >> 2) & 0x01),
+                             INT2NUM((digital >> 3) & 0x01),
+                             INT2NUM((digital >> 4) & 0x01),
+                             INT2NUM(analog1), INT2NUM(analog2),
+                             INT2NUM(counter1), INT2NUM(counter2),
+                             timestamp_to_rb(sample->timestamp));
+    return rb_obj_freeze(snapshot);
+}
+
+// Reads every input from a single packet, so all values come from the same instant.
+// With a newer_than timestamp, waits (up to timeout seconds) for a sample received
+// after that time, and returns false if none arrived.
+static VALUE method_snapshot(int argc, VALUE *argv, VALUE self) {
+    rubyk8055 *r = connected_wrapper(self);
+    VALUE newer_than, timeout;
+    k8055_sample sample;
+
+    rb_scan_args(argc, argv, "02", &newer_than, &timeout);
+    if (NIL_P(newer_than) || !IsAcquiring(r->dev)) {
+        // a direct read is always fresher than any time the caller has seen
+        checked(r, read_call(r, nogvl_read_sample, 0, 0, &sample));
+    } else {
+        long timeout_ms = NIL_P(timeout) ? 1000 : (long)(NUM2DBL(timeout) * 1000);
+        struct blocking_call call = { r->dev, timeout_ms, 0, timestamp_from_rb(newer_than),
+                                      &sample, -1, nogvl_wait_sample };
+        // waiting doesn't touch the bus, so it doesn't need the object's lock
+        unlocked_call(&call);
+        if (call.result == -1)
+            return Qfalse;
     }
-    return Qfalse;
+    return sample_to_snapshot(&sample);
 }
 
-static VALUE method_get_analog(VALUE self, long channel) {
-    if (check_connection(self)) {
-        channel = NUM2INT(channel);
-        if (valid_analog_channel(channel)) {
-            long data = ReadAnalogChannel(channel);
-            if (data != -1)
-                return INT2NUM(data);
+// ------------------- Bulk acquisition ---------------------
+
+#define ACQUIRE_COLUMNS 5
+
+// One packed column of the samples: timestamps as uint64 nanoseconds, the
+// digital mask and analog inputs as uint8, the counters as uint16, all
+// little-endian.
+static VALUE pack_column(const k8055_sample *samples, long n, int column) {
+    static const int widths[ACQUIRE_COLUMNS + 1] = { 8, 1, 1, 1, 2, 2 };
+    VALUE str = rb_str_new(NULL, n * widths[column]);
+    unsigned char *out = (unsigned char *)RSTRING_PTR(str);
+    long i, values[ACQUIRE_COLUMNS];
+    int b;
+
+    for (i = 0; i < n; i++) {
+        if (column == 0) {
+            for (b = 0; b < 8; b++)
+                *out++ = (unsigned char)(samples[i].timestamp >> (8 * b));
+            continue;
         }
-        printf("K8055 returned an error.\n");
-        return Qfalse;
+        DecodeValues(samples[i].packet, &values[0], &values[1], &values[2], &values[3], &values[4]);
+        values[0] = samples[i].digital;
+        *out++ = values[column - 1] & 0xff;
+        if (widths[column] == 2)
+            *out++ = (values[column - 1] >> 8) & 0xff;
     }
+    return str;
 }
 
-static VALUE method_set_analog(VALUE self, long channel, long value) {
-    if (check_connection(self)) {
-        channel = NUM2INT(channel);
-        value = NUM2INT(value);
-        if (valid_analog_value(value)) {
-            if (valid_analog_channel(channel)) {
-                if (OutputAnalogChannel(channel, value) != -1)
-                    return Qtrue;
-            }
+static VALUE acquire_stats_to_rb(const k8055_acquire_stats *stats) {
+    VALUE hash = rb_hash_new();
+
+    rb_hash_aset(hash, ID2SYM(id_mean), DBL2NUM(stats->lateness_mean_ns / 1e9));
+    rb_hash_aset(hash, ID2SYM(id_stddev), DBL2NUM(stats->lateness_stddev_ns / 1e9));
+    rb_hash_aset(hash, ID2SYM(id_max), DBL2NUM(stats->lateness_max_ns / 1e9));
+    rb_hash_aset(hash, ID2SYM(id_missed), ULONG2NUM(stats->missed));
+    return hash;
+}
+
+// acquire(count:, interval_us:, channels: [:digital, :analog1, :analog2,
+// :counter1, :counter2], start: nil) takes count samples, one every
+// interval_us, in a single native loop without the GVL, paced against
+// absolute deadlines. Returns { :count, :timestamps, <channel> => packed
+// String, ..., :jitter, :next }: timestamps unpack with "Q<*", digital/
+// analog1/analog2 with "C*" and the counters with "S<*". :jitter holds the
+// mean, stddev and max (in seconds) of how late each packet arrived after its
+// scheduled time, and the reads that overran the interval. Stops early, with
+// what it has, if a read fails (and raises Error if it has none).
+// start is the CLOCK_MONOTONIC time the first sample is due (default now);
+// passing the previous result's :next continues its schedule.
+static VALUE method_acquire(int argc, VALUE *argv, VALUE self) {
+    ID column_ids[ACQUIRE_COLUMNS] = { id_digital, id_analog1, id_analog2, id_counter1, id_counter2 };
+    ID keys[4] = { id_count, id_interval_us, id_channels, id_start };
+    VALUE opts, kwargs[4], tmp, result;
+    int wanted[ACQUIRE_COLUMNS] = { true, true, true, true, true };
+    struct acquire_buffers buffers;
+    struct blocking_call call;
+    long count, interval_us, i;
+    rubyk8055 *r;
+    int c;
+
+    rb_scan_args(argc, argv, ":", &opts);
+    rb_get_kwargs(opts, keys, 2, 2, kwargs);
+    count = NUM2LONG(kwargs[0]);
+    interval_us = NUM2LONG(kwargs[1]);
+    if (count < 0 || interval_us < 0)
+        rb_raise(rb_eArgError, "count and interval_us must not be negative");
+    if (kwargs[2] != Qundef && !NIL_P(kwargs[2])) {
+        VALUE channels = rb_Array(kwargs[2]);
+
+        for (c = 0; c < ACQUIRE_COLUMNS; c++)
+            wanted[c] = false;
+        for (i = 0; i < RARRAY_LEN(channels); i++) {
+            ID id = rb_sym2id(rb_ary_entry(channels, i));
+
+            for (c = 0; c < ACQUIRE_COLUMNS && column_ids[c] != id; c++)
+                ;
+            if (c == ACQUIRE_COLUMNS)
+                rb_raise(rb_eArgError, "unknown channel %"PRIsVALUE
+                         " (expected :digital, :analog1, :analog2, :counter1 or :counter2)",
+                         rb_ary_entry(channels, i));
+            wanted[c] = true;
         }
-        printf("K8055 returned an error.\n");
-        return Qfalse;
     }
+    r = connected_wrapper(self);
+
+    buffers.samples = ALLOCV_N(k8055_sample, tmp, count > 0 ? count : 1);
+    call.k = r->dev;
+    call.arg1 = count;
+    call.arg2 = interval_us;
+    call.time = kwargs[3] == Qundef || NIL_P(kwargs[3]) ? 0 : timestamp_from_rb(kwargs[3]);
+    call.out = &buffers;
+    call.result = -1;
+    call.func = nogvl_acquire;
+    // like waiting for a snapshot, this doesn't hold the object's lock, so
+    // outputs can still be written from other threads while it runs
+    unlocked_call(&call);
+    if (call.result == -1 && count > 0) {
+        ALLOCV_END(tmp);
+        device_error(r);
+    }
+
+    result = rb_hash_new();
+    rb_hash_aset(result, ID2SYM(id_count), LONG2NUM(buffers.stats.count));
+    rb_hash_aset(result, ID2SYM(id_timestamps), pack_column(buffers.samples, buffers.stats.count, 0));
+    for (c = 0; c < ACQUIRE_COLUMNS; c++)
+        if (wanted[c])
+            rb_hash_aset(result, ID2SYM(column_ids[c]), pack_column(buffers.samples, buffers.stats.count, c + 1));
+    rb_hash_aset(result, ID2SYM(id_jitter), acquire_stats_to_rb(&buffers.stats));
+    rb_hash_aset(result, ID2SYM(id_next), timestamp_to_rb(buffers.stats.next_deadline));
+    ALLOCV_END(tmp);
+    return result;
 }
 
-static VALUE method_set_analog_max(VALUE self, long channel) {
-    return method_set_analog(self, channel, 255);
+static VALUE method_start_acquisition(VALUE self) {
+    if (StartAcquisition(connected_wrapper(self)->dev) == -1)
+        rb_raise(eK8055Error, "could not start the acquisition thread");
+    return Qtrue;
 }
 
-static VALUE method_set_analog_min(VALUE self, long channel) {
-    return method_set_analog(self, channel, INT2NUM(0));
+static VALUE method_stop_acquisition(VALUE self) {
+    blocking_call(get_wrapper(self), nogvl_stop_acquisition, 0, 0, NULL);
+    return Qtrue;
 }
 
-static VALUE method_get_digital(VALUE self, long channel) {
-    if (check_connection(self)) {
-        channel = NUM2INT(channel);
-        if (valid_digital_input_channel(channel)) {
-            long data = ReadDigitalChannel(channel);
-            if (data != -1)
-                return INT2NUM(data);
-        }
-        printf("K8055 returned an error.\n");
-        return Qfalse;
-    }
+static VALUE method_acquiring(VALUE self) {
+    return IsAcquiring(get_device(self)) ? Qtrue : Qfalse;
 }
 
-static VALUE method_set_digital(VALUE self, long channel, int value) {
-    if (check_connection(self)) {
-        channel = NUM2INT(channel);
-        if (value != 0) {   // simple boolean conversion from non-zero to true
-            value = true;
-        }
-        if (valid_digital_output_channel(channel)) {
-            if (value == true) {
-                if (SetDigitalChannel(channel) != -1)
-                    return Qtrue;
-            } else {
-                if (ClearDigitalChannel(channel) != -1)
-                    return Qtrue;
-            }
-        }
-        printf("K8055 returned an error.\n");
-        return Qfalse;
-    }
+// :confirm reads a packet back after every write (the default), :no_confirm
+// skips the read back and :deferred lets the next input read confirm it. In the
+// last two modes failed writes are counted in #write_errors and reported to
+// the #on_write_error block instead of raising Error.
+static VALUE method_set_write_mode(VALUE self, VALUE mode) {
+    ID id = SYM2ID(mode);
+    int write_mode;
+
+    if (id == id_confirm)
+        write_mode = K8055_WRITE_CONFIRM;
+    else if (id == id_no_confirm)
+        write_mode = K8055_WRITE_NO_CONFIRM;
+    else if (id == id_deferred)
+        write_mode = K8055_WRITE_DEFERRED;
+    else
+        rb_raise(rb_eArgError, "write mode must be :confirm, :no_confirm or :deferred");
+    SetWriteMode(get_device(self), write_mode);
+    return mode;
 }
 
-static VALUE method_write_all_digital(VALUE self, int value) {
-    if (check_connection(self)) {
-        value = NUM2INT(value);
-        if (WriteAllDigital(value) != -1)
-            return Qtrue;
-        printf("K8055 returned an error.\n");
-        return Qfalse;
+static VALUE method_write_mode(VALUE self) {
+    switch (GetWriteMode(get_device(self))) {
+    case K8055_WRITE_NO_CONFIRM:
+        return ID2SYM(id_no_confirm);
+    case K8055_WRITE_DEFERRED:
+        return ID2SYM(id_deferred);
+    default:
+        return ID2SYM(id_confirm);
     }
 }
 
-static VALUE method_set_all_digital(VALUE self) {
-    if (check_connection(self)) {
-        if (SetAllDigital() != -1)
-            return Qtrue;
-        printf("K8055 returned an error.\n");
-        return Qfalse;
-    }
+// Input reads reuse a packet up to max_age seconds old instead of reading the
+// board again; 0 (the default) reads every time. Threads that call at the
+// same time queue on the board, and all get the packet the first one read.
+static VALUE method_set_read_cache_age(VALUE self, VALUE max_age) {
+    SetReadCacheAge(get_device(self), (long)(NUM2DBL(max_age) * 1e6));
+    return max_age;
 }
 
-static VALUE method_clear_all_digital(VALUE self) {
-    if (check_connection(self)) {
-        if (ClearAllDigital() != -1)
-            return Qtrue;
-        printf("K8055 returned an error.\n");
-        return Qfalse;
+static VALUE method_read_cache_age(VALUE self) {
+    return DBL2NUM(GetReadCacheAge(get_device(self)) / 1e6);
+}
+
+static VALUE method_write_errors(VALUE self) {
+    return ULONG2NUM(GetWriteErrors(get_device(self)));
+}
+
+static VALUE method_on_write_error(VALUE self) {
+    get_wrapper(self)->on_write_error = rb_block_given_p() ? rb_block_proc() : Qnil;
+    return self;
+}
+
+struct batch_args {
+    VALUE self;
+    rubyk8055 *r;
+    VALUE outer;        // batch_thread of an enclosing #batch
+    long result;
+};
+
+static VALUE batch_body(VALUE arg) {
+    return rb_yield(((struct batch_args *)arg)->self);
+}
+
+static VALUE batch_flush(VALUE arg) {
+    struct batch_args *batch = (struct batch_args *)arg;
+    batch->result = blocking_call(batch->r, nogvl_end_batch, 0, 0, NULL);
+    batch->r->batch_thread = batch->outer;
+    return Qnil;
+}
+
+// Runs with the object's lock held
+static VALUE locked_batch(VALUE arg) {
+    struct batch_args *batch = (struct batch_args *)arg;
+
+    batch->outer = batch->r->batch_thread;
+    batch->r->batch_thread = rb_thread_current();
+    BeginOutputBatch(batch->r->dev);
+    return rb_ensure(batch_body, arg, batch_flush, arg);
+}
+
+// Stages every digital/analog output change made inside the block and sends
+// them in a single packet when the block ends (even if it raises, since the
+// staged values would otherwise go out with the next write anyway).
+// The block holds the object's lock, so other threads' calls wait for it
+// instead of having their changes staged into this batch.
+static VALUE method_batch(VALUE self) {
+    struct batch_args batch = { self, connected_wrapper(self), Qnil, 0 };
+
+    rb_need_block();
+    if (batch.r->batch_thread == rb_thread_current())
+        locked_batch((VALUE)&batch);    // nested, the lock is already held
+    else
+        rb_mutex_synchronize(batch.r->lock, locked_batch, (VALUE)&batch);
+    checked(batch.r, batch.result);
+    return Qtrue;
+}
+
+// With async output on, digital/analog output calls only stage the new state
+// and return at once; a native writer thread sends the latest state as fast
+// as the board takes packets, so changes in between collapse into one packet.
+// Failed writes are retried and counted in #write_errors. Turning it off
+// sends whatever is still staged first.
+static VALUE method_set_async_output(VALUE self, VALUE enable) {
+    rubyk8055 *r = connected_wrapper(self);
+    checked(r, blocking_call(r, nogvl_set_async_output, RTEST(enable), 0, NULL));
+    return enable;
+}
+
+static VALUE method_async_output(VALUE self) {
+    return GetAsyncOutput(get_device(self)) ? Qtrue : Qfalse;
+}
+
+// Waits up to timeout seconds (1 by default, nil for no limit) until every
+// output change made before the call has reached the board. True at once
+// without async output.
+static VALUE method_flush(int argc, VALUE *argv, VALUE self) {
+    VALUE timeout;
+    rubyk8055 *r = get_wrapper(self);
+
+    rb_scan_args(argc, argv, "01", &timeout);
+    long timeout_ms = argc == 0 ? 1000 : NIL_P(timeout) ? -1 : (long)(NUM2DBL(timeout) * 1000);
+    struct blocking_call call = { r->dev, timeout_ms, 0, 0, NULL, -1, nogvl_flush_outputs };
+    // the writer thread does the transfers, so waiting doesn't need the object's lock
+    unlocked_call(&call);
+    return call.result != -1 ? Qtrue : Qfalse;
+}
+
+// ------------------- Simulated board ---------------------
+
+// Only for boards connected with the :sim transport; on real hardware these
+// raise Error.
+
+NORETURN(static void not_simulated(void));
+
+static void not_simulated(void) {
+    rb_raise(eK8055Error, "K8055 is not a simulated board");
+}
+
+static VALUE method_sim_configure(int argc, VALUE *argv, VALUE self) {
+    rubyk8055 *r = connected_wrapper(self);
+    VALUE latency, jitter, failure_rate;
+    double rate;
+
+    rb_scan_args(argc, argv, "12", &latency, &jitter, &failure_rate);
+    rate = NIL_P(failure_rate) ? 0.0 : NUM2DBL(failure_rate);
+    if (blocking_call(r, nogvl_sim_configure, NUM2LONG(latency),
+                      NIL_P(jitter) ? 0 : NUM2LONG(jitter), &rate) == -1)
+        not_simulated();
+    return Qtrue;
+}
+
+static VALUE method_sim_inputs(VALUE self, VALUE digital, VALUE analog1, VALUE analog2) {
+    rubyk8055 *r = connected_wrapper(self);
+    long analog[2];
+
+    analog[0] = NUM2LONG(analog1);
+    analog[1] = NUM2LONG(analog2);
+    if (blocking_call(r, nogvl_sim_inputs, NUM2LONG(digital), 0, analog) == -1)
+        not_simulated();
+    return Qtrue;
+}
+
+static VALUE method_sim_pulse_counter(VALUE self, VALUE counter, VALUE pulses) {
+    rubyk8055 *r = connected_wrapper(self);
+
+    if (blocking_call(r, nogvl_sim_pulse_counter, counter_number(counter), NUM2LONG(pulses), NULL) == -1)
+        not_simulated();
+    return Qtrue;
+}
+
+// Drops the simulated board off the bus; it can be reopened after seconds
+static VALUE method_sim_unplug(VALUE self, VALUE seconds) {
+    rubyk8055 *r = connected_wrapper(self);
+
+    if (blocking_call(r, nogvl_sim_unplug, (long)(NUM2DBL(seconds) * 1000), 0, NULL) == -1)
+        not_simulated();
+    return Qtrue;
+}
+
+// [digital, analog1, analog2] as last written to the simulated board
+static VALUE method_sim_outputs(VALUE self) {
+    rubyk8055 *r = connected_wrapper(self);
+    long outputs[3];
+
+    if (blocking_call(r, nogvl_sim_outputs, 0, 0, outputs) == -1)
+        not_simulated();
+    return rb_ary_new3(3, LONG2NUM(outputs[0]), LONG2NUM(outputs[1]), LONG2NUM(outputs[2]));
+}
+
+// ------------------- Sequence player ---------------------
+
+// play_sequence([[digital, analog1, analog2, seconds], ...], loop=false)
+// Uploads the frames and returns at once; a native thread sends each frame
+// and holds it for its duration, timed against absolute deadlines.
+static VALUE method_play_sequence(int argc, VALUE *argv, VALUE self) {
+    rubyk8055 *r = connected_wrapper(self);
+    VALUE frames, loop, tmp;
+    k8055_frame *buf;
+    long i, count, rval;
+
+    rb_scan_args(argc, argv, "11", &frames, &loop);
+    Check_Type(frames, T_ARRAY);
+    count = RARRAY_LEN(frames);
+    if (count == 0)
+        rb_raise(rb_eArgError, "sequence has no frames");
+    buf = ALLOCV_N(k8055_frame, tmp, count);
+    for (i = 0; i < count; i++) {
+        VALUE frame = rb_ary_entry(frames, i);
+        double seconds;
+
+        Check_Type(frame, T_ARRAY);
+        if (RARRAY_LEN(frame) != 4)
+            rb_raise(rb_eArgError, "frame %ld: expected [digital, analog1, analog2, seconds]", i);
+        buf[i].digital = NUM2INT(rb_ary_entry(frame, 0)) & 0xff;
+        buf[i].analog1 = NUM2INT(rb_ary_entry(frame, 1)) & 0xff;
+        buf[i].analog2 = NUM2INT(rb_ary_entry(frame, 2)) & 0xff;
+        seconds = NUM2DBL(rb_ary_entry(frame, 3));
+        buf[i].duration_us = seconds > 0 ? (unsigned long)(seconds * 1e6) : 0;
     }
+    rval = blocking_call(r, nogvl_play_sequence, count, RTEST(loop), buf);
+    ALLOCV_END(tmp);
+    if (rval == -1)
+        rb_raise(eK8055Error, "could not start the sequence");
+    return Qtrue;
 }
 
-static VALUE method_set_all_analog(VALUE self) {
-    if (check_connection(self)) {
-        if (SetAllAnalog() != -1)
-            return Qtrue;
-        printf("K8055 returned an error.\n");
-        return Qfalse;
+static VALUE method_stop_sequence(VALUE self) {
+    blocking_call(get_wrapper(self), nogvl_stop_sequence, 0, 0, NULL);
+    return Qtrue;
+}
+
+static VALUE method_seek_sequence(VALUE self, VALUE frame) {
+    return SeekSequence(get_device(self), NUM2ULONG(frame)) != -1 ? Qtrue : Qfalse;
+}
+
+static VALUE method_playing(VALUE self) {
+    return SequenceStatus(get_device(self), NULL, NULL) ? Qtrue : Qfalse;
+}
+
+static VALUE method_sequence_position(VALUE self) {
+    unsigned long frame;
+    SequenceStatus(get_device(self), &frame, NULL);
+    return ULONG2NUM(frame);
+}
+
+static VALUE method_missed_deadlines(VALUE self) {
+    unsigned long missed;
+    SequenceStatus(get_device(self), NULL, &missed);
+    return ULONG2NUM(missed);
+}
+
+// ------------------- Edge events ---------------------
+
+// Digital input changes are found in native code, by diffing the packets the
+// acquisition thread reads, and queued. One Ruby thread per board sleeps
+// without the GVL until edges arrive and then calls the registered blocks.
+
+#define EDGE_BATCH 32
+
+struct edge_wait {
+    k8055_dev *k;
+    k8055_edge edges[EDGE_BATCH];
+    int count;
+};
+
+static void *nogvl_wait_edges(void *p) {
+    struct edge_wait *w = p;
+    w->count = WaitEdges(w->k, w->edges, EDGE_BATCH, -1);
+    return NULL;
+}
+
+static void unblock_edges(void *k) {
+    CancelEdgeWait((k8055_dev *)k);
+}
+
+struct edge_call {
+    VALUE block;
+    int argc;
+    VALUE argv[3];
+};
+
+static VALUE call_listener(VALUE arg) {
+    struct edge_call *call = (struct edge_call *)arg;
+    return rb_funcallv(call->block, id_call, call->argc, call->argv);
+}
+
+// A block that raises an error is reported and skipped, so it can't stop the event
+// thread for every other block.
+static void call_listeners(VALUE blocks, struct edge_call *call) {
+    long i;
+    int state;
+
+    for (i = 0; !NIL_P(blocks) && i < RARRAY_LEN(blocks); i++) {
+        call->block = rb_ary_entry(blocks, i);
+        rb_protect(call_listener, (VALUE)call, &state);
+        if (state) {
+            // Thread#kill, exit and the like still end the thread
+            if (!RTEST(rb_obj_is_kind_of(rb_errinfo(), rb_eStandardError)))
+                rb_jump_tag(state);
+            rb_warn("K8055 edge event block raised: %"PRIsVALUE, rb_errinfo());
+            rb_set_errinfo(Qnil);
+        }
     }
 }
 
-static VALUE method_clear_all_analog(VALUE self) {
-    if (check_connection(self)) {
-        if (ClearAllAnalog() != -1)
-            return Qtrue;
-        printf("K8055 returned an error.\n");
-        return Qfalse;
+static void dispatch_edge(rubyk8055 *r, const k8055_edge *edge) {
+    struct edge_call call;
+    VALUE channel = INT2NUM(edge->channel);
+
+    call.argc = 2;
+    call.argv[0] = ID2SYM(edge->rising ? id_rising : id_falling);
+    call.argv[1] = timestamp_to_rb(edge->timestamp);
+    call_listeners(rb_hash_lookup(r->listeners, channel), &call);
+
+    call.argc = 3;
+    call.argv[2] = call.argv[1];
+    call.argv[1] = call.argv[0];
+    call.argv[0] = channel;
+    call_listeners(rb_hash_lookup(r->listeners, INT2FIX(0)), &call);
+}
+
+static VALUE event_loop(void *arg) {
+    rubyk8055 *r = get_wrapper((VALUE)arg);
+    struct edge_wait wait;
+    int i;
+
+    wait.k = r->dev;
+    for (;;) {
+        rb_thread_call_without_gvl(nogvl_wait_edges, &wait, unblock_edges, wait.k);
+        rb_thread_check_ints();
+        if (wait.count < 0)
+            break;  // #stop_events
+        for (i = 0; i < wait.count; i++)
+            dispatch_edge(r, &wait.edges[i]);
     }
+    return Qnil;
 }
 
-static VALUE method_read_counter(VALUE self, long counter) {
-    if (check_connection(self)) {
-        counter = NUM2INT(counter);
-        if (valid_counter(counter)) {
-            long data = ReadCounter(counter);
-            data = ReadCounter(counter);    // Reads twice, to get around buffering error
-            if (data != -1)
-                return INT2NUM(data);
+static void start_events(VALUE self) {
+    rubyk8055 *r = get_wrapper(self);
+
+    // restart it if it was killed
+    if (RTEST(r->event_thread) && RTEST(rb_funcall(r->event_thread, id_alive_p, 0)))
+        return;
+    connected_wrapper(self);
+    WatchEdges(r->dev, 1);
+    if (!IsAcquiring(r->dev)) {
+        if (StartAcquisition(r->dev) == -1) {
+            WatchEdges(r->dev, 0);
+            rb_raise(eK8055Error, "could not start the acquisition thread");
         }
-        printf("K8055 returned an error.\n");
-        return Qfalse;
+        r->events_acquire = true;
     }
+    r->event_thread = rb_thread_create(event_loop, (void *)self);
+    // the thread only gets the object as a raw pointer; keep it alive
+    rb_ivar_set(r->event_thread, id_iv_k8055, self);
 }
 
-static VALUE method_reset_counter(VALUE self, long counter) {
-    if (check_connection(self)) {
-        counter = NUM2INT(counter);
-        if (valid_counter(counter)) {
-            if (ResetCounter(counter) != -1)
-                return Qtrue;
-        }
-        printf("K8055 returned an error.\n");
-        return Qfalse;
+static void add_listener(VALUE self, VALUE channel, VALUE block) {
+    rubyk8055 *r = get_wrapper(self);
+    VALUE blocks = rb_hash_lookup(r->listeners, channel);
+
+    if (NIL_P(blocks)) {
+        blocks = rb_ary_new();
+        rb_hash_aset(r->listeners, channel, blocks);
     }
+    rb_ary_push(blocks, block);
 }
 
-static VALUE method_set_debounce(VALUE self, long counter, long time) {
-    if (check_connection(self)) {
-        counter = NUM2INT(counter);
-        time = NUM2INT(time);
-        if (valid_counter(counter)) {
-            if (SetCounterDebounceTime(counter, time) != -1)
-                return Qtrue;
-        }
-        printf("K8055 returned an error.\n");
+// on_change(channel) { |edge, time| }: edge is :rising or :falling, time the
+// CLOCK_MONOTONIC time of the packet that showed it. Runs the acquisition
+// thread (if it isn't already) so short pulses aren't missed.
+static VALUE method_on_change(VALUE self, VALUE channel) {
+    long c = digital_input_channel(channel);
+
+    rb_need_block();
+    start_events(self);
+    add_listener(self, LONG2FIX(c), rb_block_proc());
+    return Qtrue;
+}
+
+// on_edge { |channel, edge, time| }: like #on_change, for every input
+static VALUE method_on_edge(VALUE self) {
+    rb_need_block();
+    start_events(self);
+    add_listener(self, INT2FIX(0), rb_block_proc());
+    return Qtrue;
+}
+
+// Removes every #on_change/#on_edge block and stops the event thread (and
+// the acquisition thread, if it was started for the events).
+static VALUE method_stop_events(VALUE self) {
+    rubyk8055 *r = get_wrapper(self);
+    VALUE thread = r->event_thread;
+
+    if (NIL_P(thread))
         return Qfalse;
+    WatchEdges(r->dev, 0);
+    if (rb_thread_current() != thread)
+        rb_funcall(thread, id_join, 0);
+    r->event_thread = Qnil;
+    rb_hash_clear(r->listeners);
+    if (r->events_acquire) {
+        r->events_acquire = false;
+        blocking_call(r, nogvl_stop_acquisition, 0, 0, NULL);
     }
+    return Qtrue;
 }
 
-static VALUE method_all_inputs(VALUE self) {
-    if (check_connection(self)) {
-        // We cant be bothered figuring out pointers and arrays and conversions. Just loop and read.
-        VALUE array = rb_ary_new(); /* Create the array */
-        long i;
+static VALUE method_edges_dropped(VALUE self) {
+    return ULONG2NUM(GetEdgesDropped(get_device(self)));
+}
 
-        for(i = 1; i <= 5;i++){
-            rb_ary_push(array, method_get_digital(self, INT2NUM(i)));
-        }
-        for(i = 1; i <= 2;i++){
-            rb_ary_push(array, method_get_analog(self, INT2NUM(i)));
-        }
-        for(i = 1; i <= 2;i++){
-            rb_ary_push(array, method_read_counter(self, INT2NUM(i)));
-        }
-        return array;
-    }
+// ------------------- Flight recorder ---------------------
+
+// Keeps the last `records` input packets (every read, including those of the
+// acquisition thread) in a memory-mapped ring file that survives a crash.
+static VALUE method_start_capture(int argc, VALUE *argv, VALUE self) {
+    VALUE path, records;
+
+    rb_scan_args(argc, argv, "11", &path, &records);
+    FilePathValue(path);
+    if (blocking_call(get_wrapper(self), nogvl_start_capture, NIL_P(records) ? 65536 : NUM2LONG(records), 0,
+                      (void *)StringValueCStr(path)) == -1)
+        rb_raise(eK8055Error, "could not start capture to %s", StringValueCStr(path));
+    RB_GC_GUARD(path);
+    return Qtrue;
 }
 
-static VALUE method_to_s(VALUE self) {
-    if (check_connection(self)) {
-        VALUE array = method_all_inputs(self);
-        rb_define_variable("arry", &array);
-        return rb_eval_string("$arry.join(';')");
+static VALUE method_stop_capture(VALUE self) {
+    return blocking_call(get_wrapper(self), nogvl_stop_capture, 0, 0, NULL) != -1 ? Qtrue : Qfalse;
+}
+
+// RubyK8055.read_capture(path): the captured packets, oldest first, as
+// Snapshots. Safe to call on a file another process is still capturing to.
+static VALUE method_read_capture(VALUE klass, VALUE path) {
+    k8055_recording *recording;
+    k8055_sample sample;
+    VALUE samples;
+
+    FilePathValue(path);
+    recording = OpenRecording(StringValueCStr(path));
+    if (recording == NULL)
+        rb_raise(rb_eArgError, "not a K8055 capture file: %s", StringValueCStr(path));
+    samples = rb_ary_new();
+    while (NextRecordedSample(recording, &sample))
+        rb_ary_push(samples, sample_to_snapshot(&sample));
+    CloseRecording(recording);
+    return samples;
+}
+
+// ------------------- Instrumentation ---------------------
+
+static VALUE transfer_stats_to_rb(const k8055_transfer_stats *stats) {
+    VALUE hash = rb_hash_new();
+    VALUE histogram = rb_ary_new2(K8055_HIST_BUCKETS);
+    int i;
+
+    rb_hash_aset(hash, ID2SYM(id_transfers), ULONG2NUM(stats->transfers));
+    rb_hash_aset(hash, ID2SYM(id_retries), ULONG2NUM(stats->retries));
+    rb_hash_aset(hash, ID2SYM(id_timeouts), ULONG2NUM(stats->timeouts));
+    rb_hash_aset(hash, ID2SYM(id_short_packets), ULONG2NUM(stats->short_packets));
+    rb_hash_aset(hash, ID2SYM(id_errors), ULONG2NUM(stats->errors));
+    rb_hash_aset(hash, ID2SYM(id_failures), ULONG2NUM(stats->failures));
+    rb_hash_aset(hash, ID2SYM(id_skipped), ULONG2NUM(stats->skipped));
+    rb_hash_aset(hash, ID2SYM(id_time), DBL2NUM(stats->time_ns / 1e9));
+    for (i = 0; i < K8055_HIST_BUCKETS; i++)
+        rb_ary_push(histogram, ULONG2NUM(stats->histogram[i]));
+    rb_hash_aset(hash, ID2SYM(id_histogram), histogram);
+    return hash;
+}
+
+// Transfer counters and latency histograms since connect (or #reset_stats):
+// { :read => {...}, :write => {...} }. histogram[i] counts transfers that took
+// at most LATENCY_BUCKETS[i] seconds and more than the bucket before.
+static VALUE method_stats(VALUE self) {
+    k8055_stats stats;
+    VALUE hash = rb_hash_new();
+
+    GetStats(get_device(self), &stats);
+    rb_hash_aset(hash, ID2SYM(id_read), transfer_stats_to_rb(&stats.read));
+    rb_hash_aset(hash, ID2SYM(id_write), transfer_stats_to_rb(&stats.write));
+    return hash;
+}
+
+static VALUE method_reset_stats(VALUE self) {
+    ResetStats(get_device(self));
+    return Qtrue;
+}
+
+// Reads one input packet, raising Error if there isn't one.
+static void read_sample(VALUE self, k8055_sample *sample) {
+    rubyk8055 *r = connected_wrapper(self);
+    checked(r, read_call(r, nogvl_read_sample, 0, 0, sample));
+}
+
+// The 8-byte input packet exactly as the board sent it, as a frozen binary String.
+static VALUE method_read_raw(VALUE self) {
+    k8055_sample sample;
+
+    read_sample(self, &sample);
+    return rb_obj_freeze(rb_str_new((const char *)sample.packet, sizeof(sample.packet)));
+}
+
+// Packed sample layout written by #read_into, little-endian (PACKED_FORMAT):
+//   0  uint64  timestamp, CLOCK_MONOTONIC nanoseconds
+//   8  uint8   digital inputs, input 1 = bit 0
+//   9  uint8   analog 1
+//  10  uint8   analog 2
+//  11  uint8   0
+//  12  uint16  counter 1
+//  14  uint16  counter 2
+#define PACKED_SIZE 16
+
+static void pack_sample(const k8055_sample *sample, unsigned char *out) {
+    long digital, analog1, analog2, counter1, counter2;
+    int i;
+
+    DecodeValues(sample->packet, &digital, &analog1, &analog2, &counter1, &counter2);
+    digital = sample->digital;
+    for (i = 0; i < 8; i++)
+        out[i] = (unsigned char)(sample->timestamp >> (8 * i));
+    out[8] = (unsigned char)digital;
+    out[9] = (unsigned char)analog1;
+    out[10] = (unsigned char)analog2;
+    out[11] = 0;
+    out[12] = counter1 & 0xff;
+    out[13] = (counter1 >> 8) & 0xff;
+    out[14] = counter2 & 0xff;
+    out[15] = (counter2 >> 8) & 0xff;
+}
+
+// Reads a sample and writes it in the packed layout into buffer (a mutable String
+// or an IO::Buffer) at offset, without allocating. Returns the offset just past
+// it, so successive calls fill the buffer.
+static VALUE method_read_into(int argc, VALUE *argv, VALUE self) {
+    VALUE buffer, offset;
+    k8055_sample sample;
+    unsigned char *base;
+    size_t size;
+    long pos;
+
+    rb_scan_args(argc, argv, "11", &buffer, &offset);
+    pos = NIL_P(offset) ? 0 : NUM2LONG(offset);
+    if (RB_TYPE_P(buffer, T_STRING)) {
+        rb_str_modify(buffer);
+        base = (unsigned char *)RSTRING_PTR(buffer);
+        size = RSTRING_LEN(buffer);
+    }
+#ifdef HAVE_RB_IO_BUFFER_GET_BYTES_FOR_WRITING
+    else if (rb_obj_is_kind_of(buffer, rb_cIOBuffer)) {
+        void *bytes;
+        rb_io_buffer_get_bytes_for_writing(buffer, &bytes, &size);
+        base = bytes;
+    }
+#endif
+    else
+        rb_raise(rb_eTypeError, "buffer must be a String or IO::Buffer");
+    if (pos < 0 || (size_t)pos + PACKED_SIZE > size)
+        rb_raise(rb_eIndexError, "no room for a %d byte sample at offset %ld", PACKED_SIZE, pos);
+
+    read_sample(self, &sample);
+    // the buffer may have been resized or freed while the GVL was released
+    if (RB_TYPE_P(buffer, T_STRING)) {
+        if ((size_t)pos + PACKED_SIZE > (size_t)RSTRING_LEN(buffer))
+            rb_raise(rb_eIndexError, "buffer shrank during the read");
+        base = (unsigned char *)RSTRING_PTR(buffer);
+    }
+#ifdef HAVE_RB_IO_BUFFER_GET_BYTES_FOR_WRITING
+    else {
+        void *bytes;
+        rb_io_buffer_get_bytes_for_writing(buffer, &bytes, &size);
+        if ((size_t)pos + PACKED_SIZE > size)
+            rb_raise(rb_eIndexError, "buffer shrank during the read");
+        base = bytes;
     }
+#endif
+    pack_sample(&sample, base + pos);
+    return LONG2NUM(pos + PACKED_SIZE);
 }
 
+static VALUE method_all_inputs(VALUE self) {
+    k8055_sample sample;
+    long digital, analog1, analog2, counter1, counter2;
+
+    read_sample(self, &sample);
+    DecodeValues(sample.packet, &digital, &analog1, &analog2, &counter1, &counter2);
+    digital = sample.digital;
+    return rb_ary_new_from_args(9,
+                                INT2FIX(digital & 0x01), INT2FIX((digital >> 1) & 0x01),
+                                INT2FIX((digital >> 2) & 0x01), INT2FIX((digital >> 3) & 0x01),
+                                INT2FIX((digital >> 4) & 0x01),
+                                INT2FIX(analog1), INT2FIX(analog2),
+                                INT2FIX(counter1), INT2FIX(counter2));
+}
 
-static VALUE rubyk8055Init(VALUE self) {
-  rb_iv_set(self, "@connected", Qfalse);
-  rb_iv_set(self, "@board_address", INT2NUM(0));
+// The inputs joined with ";", or "" when not connected
+static VALUE method_to_s(VALUE self) {
+    if (!get_wrapper(self)->connected)
+        return rb_str_new2("");
+    return rb_ary_join(method_all_inputs(self), rb_str_new2(";"));
 }
 
 // ----------------------- RubyK8055 class initialization ----------------------
 
-void Init_rubyk8055() {
+void Init_rubyk8055(void) {
 
     VALUE USB = rb_define_module("USB");
-    VALUE RubyK8055 = rb_define_class_under(USB, "RubyK8055", rb_cObject);
+    id_call = rb_intern("call");
+    id_confirm = rb_intern("confirm");
+    id_no_confirm = rb_intern("no_confirm");
+    id_deferred = rb_intern("deferred");
+    id_rising = rb_intern("rising");
+    id_falling = rb_intern("falling");
+    id_count = rb_intern("count");
+    id_interval_us = rb_intern("interval_us");
+    id_channels = rb_intern("channels");
+    id_start = rb_intern("start");
+    id_digital = rb_intern("digital");
+    id_analog1 = rb_intern("analog1");
+    id_analog2 = rb_intern("analog2");
+    id_counter1 = rb_intern("counter1");
+    id_counter2 = rb_intern("counter2");
+    id_timestamps = rb_intern("timestamps");
+    id_jitter = rb_intern("jitter");
+    id_next = rb_intern("next");
+    id_samples = rb_intern("samples");
+    id_mean = rb_intern("mean");
+    id_stddev = rb_intern("stddev");
+    id_median = rb_intern("median");
+    id_min = rb_intern("min");
+    id_max = rb_intern("max");
+    id_smoothed = rb_intern("smoothed");
+    id_missed = rb_intern("missed");
+    id_read = rb_intern("read");
+    id_write = rb_intern("write");
+    id_transfers = rb_intern("transfers");
+    id_retries = rb_intern("retries");
+    id_timeouts = rb_intern("timeouts");
+    id_short_packets = rb_intern("short_packets");
+    id_errors = rb_intern("errors");
+    id_failures = rb_intern("failures");
+    id_skipped = rb_intern("skipped");
+    id_time = rb_intern("time");
+    id_histogram = rb_intern("histogram");
+    id_alive_p = rb_intern("alive?");
+    id_join = rb_intern("join");
+    id_iv_k8055 = rb_intern("@k8055");
 
-    rb_define_method(RubyK8055, "initialize", rubyk8055Init, 0);
+    RubyK8055 = rb_define_class_under(USB, "RubyK8055", rb_cObject);
+    eK8055Error = rb_define_class_under(RubyK8055, "Error", rb_eStandardError);
+    eNotConnected = rb_define_class_under(RubyK8055, "NotConnectedError", eK8055Error);
+
+    cSnapshot = rb_struct_define_under(RubyK8055, "Snapshot",
+                                       "digital1", "digital2", "digital3", "digital4", "digital5",
+                                       "analog1", "analog2", "counter1", "counter2", "timestamp", NULL);
+    rb_global_variable(&cSnapshot);
+
+    // upper bounds of the #stats latency histogram buckets, in seconds
+    {
+        static const unsigned long bounds[K8055_HIST_BUCKETS - 1] = K8055_HIST_BOUNDS_US;
+        VALUE buckets = rb_ary_new2(K8055_HIST_BUCKETS);
+        int i;
+
+        for (i = 0; i < K8055_HIST_BUCKETS - 1; i++)
+            rb_ary_push(buckets, DBL2NUM(bounds[i] / 1e6));
+        rb_ary_push(buckets, DBL2NUM(HUGE_VAL));
+        rb_define_const(RubyK8055, "LATENCY_BUCKETS", rb_obj_freeze(buckets));
+    }
+
+    rb_define_alloc_func(RubyK8055, rubyk8055_alloc);
 
     rb_define_method(RubyK8055, "connect", method_connect, -1);
     rb_define_method(RubyK8055, "disconnect", method_disconnect, 0);
+    rb_define_method(RubyK8055, "connected", method_connected, 0);
+    rb_define_method(RubyK8055, "connected?", method_connected, 0);
+    rb_define_method(RubyK8055, "board_address", method_board_address, 0);
+    rb_define_method(RubyK8055, "auto_reconnect=", method_set_auto_reconnect, 1);
+    rb_define_method(RubyK8055, "auto_reconnect?", method_auto_reconnect, 0);
+    rb_define_method(RubyK8055, "reconnects", method_reconnects, 0);
 
     rb_define_method(RubyK8055, "get_analog", method_get_analog, 1);
     rb_define_method(RubyK8055, "set_analog", method_set_analog, 2);
+    rb_define_method(RubyK8055, "analog_filter", method_analog_filter, -1);
+    rb_define_method(RubyK8055, "analog_stats", method_analog_stats, 1);
     rb_define_method(RubyK8055, "set_analog_max", method_set_analog_max, 1);
     rb_define_method(RubyK8055, "set_analog_min", method_set_analog_min, 1);
 
     rb_define_method(RubyK8055, "get_digital", method_get_digital, 1);
     rb_define_method(RubyK8055, "set_digital", method_set_digital, 2);
+    rb_define_method(RubyK8055, "digital_on", method_digital_on, 1);
+    rb_define_method(RubyK8055, "digital_off", method_digital_off, 1);
+    rb_define_method(RubyK8055, "set_digital_debounce", method_set_digital_debounce, -1);
+    rb_define_method(RubyK8055, "digital_debounce", method_digital_debounce, 1);
+    rb_define_method(RubyK8055, "digital_glitches", method_digital_glitches, 0);
     rb_define_method(RubyK8055, "write_all_digital", method_write_all_digital, 1);
 
+    rb_define_method(RubyK8055, "digital_outputs", method_digital_outputs, 0);
+    rb_define_method(RubyK8055, "analog_outputs", method_analog_outputs, 0);
+    rb_define_method(RubyK8055, "writes_skipped", method_writes_skipped, 0);
+
     rb_define_method(RubyK8055, "set_all_digital", method_set_all_digital, 0);
     rb_define_method(RubyK8055, "clear_all_digital", method_clear_all_digital, 0);
     rb_define_method(RubyK8055, "set_all_analog", method_set_all_analog, 0);
     rb_define_method(RubyK8055, "clear_all_analog", method_clear_all_analog, 0);
 
+    rb_define_method(RubyK8055, "batch", method_batch, 0);
+    rb_define_method(RubyK8055, "write_mode=", method_set_write_mode, 1);
+    rb_define_method(RubyK8055, "write_mode", method_write_mode, 0);
+    rb_define_method(RubyK8055, "async_output=", method_set_async_output, 1);
+    rb_define_method(RubyK8055, "async_output?", method_async_output, 0);
+    rb_define_method(RubyK8055, "flush", method_flush, -1);
+    rb_define_method(RubyK8055, "wait_written", method_flush, -1);
+    rb_define_method(RubyK8055, "write_errors", method_write_errors, 0);
+    rb_define_method(RubyK8055, "read_cache_age=", method_set_read_cache_age, 1);
+    rb_define_method(RubyK8055, "read_cache_age", method_read_cache_age, 0);
+    rb_define_method(RubyK8055, "on_write_error", method_on_write_error, 0);
+
+    rb_define_method(RubyK8055, "snapshot", method_snapshot, -1);
     rb_define_method(RubyK8055, "all_inputs", method_all_inputs, 0);
+    rb_define_method(RubyK8055, "read_raw", method_read_raw, 0);
+    rb_define_method(RubyK8055, "read_into", method_read_into, -1);
+    rb_define_const(RubyK8055, "PACKED_FORMAT", rb_obj_freeze(rb_str_new2("Q<CCCxS<S<")));
+    rb_define_const(RubyK8055, "PACKED_SIZE", INT2FIX(PACKED_SIZE));
     rb_define_method(RubyK8055, "to_s", method_to_s, 0);
 
+    rb_define_method(RubyK8055, "start_acquisition", method_start_acquisition, 0);
+    rb_define_method(RubyK8055, "stop_acquisition", method_stop_acquisition, 0);
+    rb_define_method(RubyK8055, "acquiring?", method_acquiring, 0);
+    rb_define_method(RubyK8055, "acquire", method_acquire, -1);
+
     rb_define_method(RubyK8055, "read_counter", method_read_counter, 1);
     rb_define_method(RubyK8055, "reset_counter", method_reset_counter, 1);
     rb_define_method(RubyK8055, "set_debounce", method_set_debounce, 2);
+    rb_define_method(RubyK8055, "counter_total", method_counter_total, 1);
+    rb_define_method(RubyK8055, "counter_rate", method_counter_rate, -1);
+
+    rb_define_method(RubyK8055, "play_sequence", method_play_sequence, -1);
+    rb_define_method(RubyK8055, "stop_sequence", method_stop_sequence, 0);
+    rb_define_method(RubyK8055, "seek_sequence", method_seek_sequence, 1);
+    rb_define_method(RubyK8055, "playing?", method_playing, 0);
+    rb_define_method(RubyK8055, "sequence_position", method_sequence_position, 0);
+    rb_define_method(RubyK8055, "missed_deadlines", method_missed_deadlines, 0);
+
+    rb_define_method(RubyK8055, "on_change", method_on_change, 1);
+    rb_define_method(RubyK8055, "on_edge", method_on_edge, 0);
+    rb_define_method(RubyK8055, "stop_events", method_stop_events, 0);
+    rb_define_method(RubyK8055, "edges_dropped", method_edges_dropped, 0);
+
+    rb_define_method(RubyK8055, "start_capture", method_start_capture, -1);
+    rb_define_method(RubyK8055, "stop_capture", method_stop_capture, 0);
+    rb_define_singleton_method(RubyK8055, "read_capture", method_read_capture, 1);
+
+    rb_define_method(RubyK8055, "stats", method_stats, 0);
+    rb_define_method(RubyK8055, "reset_stats", method_reset_stats, 0);
 
-    // reopen the class and define some handy attr_accessors.. (and some pseudo-alias methods)
-    rb_eval_string("module USB \n\
-                        class RubyK8055 \n\
-                            attr_accessor :connected, :board_address \n\
-                            def digital_on(c); set_digital(c, true); end \n\
-                            def digital_off(c); set_digital(c, false); end \n\
-                        end \n\
-                    end");
+    rb_define_method(RubyK8055, "sim_configure", method_sim_configure, -1);
+    rb_define_method(RubyK8055, "sim_inputs", method_sim_inputs, 3);
+    rb_define_method(RubyK8055, "sim_pulse_counter", method_sim_pulse_counter, 2);
+    rb_define_method(RubyK8055, "sim_unplug", method_sim_unplug, 1);
+    rb_define_method(RubyK8055, "sim_outputs", method_sim_outputs, 0);
 }
 
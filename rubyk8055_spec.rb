@@ -1,11 +1,15 @@
 # Simple real-world rspec tests to make sure the wrapper is functioning properly
 # with a real, connected device.
 
+# Without a board, run them against the simulated K8055:
+#   K8055_TRANSPORT=sim spec rubyk8055_spec.rb
+
 # These warnings are safe to ignore:
 # --- get driver name: could not get bound driver: No data available
 # --- Disconnected OS driver: could not set config 1: Device or resource busy
 
 require 'rubyk8055'
+require 'timeout'
 include USB
 
 describe "connecting" do
@@ -19,6 +23,18 @@ describe "connecting" do
     @r.connected.should == false
     @r.connect 0
     @r.board_address.should == 0
+    @r.disconnect
+  end
+
+  it 'should raise errors instead of returning false' do
+    lambda { @r.get_digital(1) }.should raise_error(RubyK8055::NotConnectedError)
+    @r.disconnect.should == false
+    @r.connect
+    lambda { @r.connect }.should raise_error(RubyK8055::Error)
+    lambda { @r.set_digital(9, true) }.should raise_error(ArgumentError)
+    lambda { @r.set_analog(1, 256) }.should raise_error(ArgumentError)
+    lambda { @r.read_counter(3) }.should raise_error(ArgumentError)
+    @r.disconnect
   end
 end
 
@@ -45,10 +61,34 @@ describe RubyK8055 do
     @r.set_all_digital.should == true
   end
 
+  it 'should be able to drive one board from several threads' do
+    threads = (1..4).map do |i|
+      Thread.new { 10.times.map { @r.set_digital(i, true) && @r.digital_off(i) } }
+    end
+    threads.map(&:value).flatten.should_not include(false)
+  end
+
   it 'should be able to write to all digital outputs at once' do
     @r.write_all_digital(231).should == true
   end
 
+  it 'should be able to batch output changes into one write' do
+    @r.batch do |b|
+      b.set_digital(3, true)
+      b.set_analog(1, 128)
+    end.should == true
+  end
+
+  it 'should be able to write without reading back' do
+    @r.write_mode = :no_confirm
+    errors = @r.write_errors
+    1.upto(8) { |i| @r.digital_on(i).should == true }
+    @r.clear_all_digital.should == true
+    @r.write_errors.should == errors
+    @r.write_mode = :confirm
+    @r.write_mode.should == :confirm
+  end
+
   it 'should be able to read analog inputs' do
     1.upto(2) do |i|
       v = @r.get_analog(i)
@@ -71,6 +111,23 @@ describe RubyK8055 do
     inp_arr.size.should == 9
   end
 
+  it 'should be able to return a frozen snapshot of all inputs' do
+    snap = @r.snapshot
+    snap.should be_frozen
+    snap.to_a.size.should == 10
+    snap.analog1.should >= 0 and snap.analog1.should <= 255
+  end
+
+  it 'should be able to serve inputs from the background acquisition thread' do
+    @r.start_acquisition.should == true
+    @r.acquiring?.should == true
+    t = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    @r.snapshot(t, 1.0).timestamp.should > t
+    @r.get_analog(1).should >= 0
+    @r.stop_acquisition
+    @r.acquiring?.should == false
+  end
+
   it 'should be able to return a formatted string of all inputs' do
     @r.to_s.count(";").should == 8
   end
@@ -103,3 +160,306 @@ describe RubyK8055 do
   end
 end
 
+describe "simulated board" do
+  before(:all) do
+    @r = RubyK8055.new
+    @r.connect(0, :sim)
+  end
+
+  it 'should read back the simulated inputs' do
+    @r.sim_inputs(0b10011, 12, 34).should == true
+    @r.snapshot.to_a[0, 7].should == [1, 1, 0, 0, 1, 12, 34]
+    @r.reset_counter(2)
+    @r.sim_pulse_counter(2, 5)
+    @r.read_counter(2).should == 5
+  end
+
+  it 'should keep counting past the 16-bit counter wrap' do
+    @r.reset_counter(1)
+    @r.sim_pulse_counter(1, 65000)
+    @r.counter_total(1).should == 65000
+    @r.sim_pulse_counter(1, 1000)
+    @r.read_counter(1).should == 464
+    @r.counter_total(1).should == 66000
+    @r.reset_counter(1)
+    @r.counter_total(1).should == 0
+  end
+
+  it 'should measure the counter rate' do
+    @r.start_acquisition
+    25.times { @r.sim_pulse_counter(2, 10); sleep 0.02 }
+    @r.counter_rate(2, 0.3).should be_within(100).of(500)
+    @r.stop_acquisition
+  end
+
+  it 'should reconnect a board that dropped off the bus and restore its outputs' do
+    @r.auto_reconnect = true
+    @r.write_all_digital(0x5a)
+    @r.sim_unplug(0.05)
+    lambda { @r.get_analog(1) }.should raise_error(RubyK8055::Error)
+    sleep 0.1
+    @r.get_analog(1).should == 0
+    @r.reconnects.should == 1
+    @r.sim_outputs[0].should == 0x5a
+    @r.auto_reconnect = false
+    @r.sim_inputs(0b10011, 12, 34)
+  end
+
+  it 'should restore the outputs on reconnect even inside a batch' do
+    @r.auto_reconnect = true
+    @r.write_all_digital(0x3c)
+    @r.sim_unplug(0.05)
+    lambda { @r.get_analog(1) }.should raise_error(RubyK8055::Error)
+    sleep 0.1
+    @r.batch do |b|
+      b.get_analog(1)
+      @r.sim_outputs[0].should == 0x3c
+    end
+    @r.reconnects.should == 2
+    @r.auto_reconnect = false
+  end
+
+  it 'should see the outputs that were written' do
+    @r.write_all_digital(0x81)
+    @r.set_analog(2, 99)
+    @r.sim_outputs.should == [0x81, 0, 99]
+  end
+
+  it 'should report the outputs and skip writes that change nothing' do
+    @r.write_all_digital(0b101)
+    @r.set_analog(1, 7)
+    @r.digital_outputs.should == [1, 0, 1, 0, 0, 0, 0, 0]
+    @r.analog_outputs.should == [7, 99]
+    @r.reset_stats
+    skipped = @r.writes_skipped
+    @r.digital_off(2).should == true
+    @r.digital_on(3).should == true
+    @r.set_analog(1, 7).should == true
+    @r.stats[:write][:transfers].should == 0
+    @r.writes_skipped.should == skipped + 3
+    @r.digital_off(1)
+    @r.sim_outputs.should == [0b100, 7, 99]
+  end
+
+  it 'should send a batch of output changes as one write' do
+    @r.reset_stats
+    @r.batch do |b|
+      b.write_all_digital(0x33)
+      b.digital_on(8)
+      b.set_analog(1, 10)
+      b.set_analog(2, 20)
+      b.set_analog(1, 11)
+    end.should == true
+    @r.stats[:write][:transfers].should == 1
+    @r.sim_outputs.should == [0xb3, 11, 20]
+    @r.batch do |b|
+      b.write_all_digital(0b100)
+      b.set_analog(1, 7)
+      b.set_analog(2, 99)
+    end
+    @r.sim_outputs.should == [0b100, 7, 99]
+  end
+
+  it 'should make other threads wait for a batch instead of joining it' do
+    @r.reset_stats
+    writer = nil
+    @r.batch do |b|
+      b.digital_on(1)
+      writer = Thread.new { @r.digital_on(8) }
+      writer.join(0.1).should == nil
+      @r.sim_outputs.should == [0b100, 7, 99]
+    end
+    writer.join(1).should == writer
+    @r.sim_outputs.should == [0b10000101, 7, 99]
+    @r.stats[:write][:transfers].should == 2
+    @r.write_all_digital(0b100)
+  end
+
+  it 'should write the latest outputs in the background with async output' do
+    @r.async_output = true
+    @r.async_output?.should == true
+    @r.reset_stats
+    256.times { |i| @r.write_all_digital(i) }
+    @r.set_analog(2, 42)
+    @r.wait_written(1).should == true
+    @r.sim_outputs.should == [255, 7, 42]
+    @r.stats[:write][:transfers].should <= 257
+    @r.write_all_digital(0x0c)
+    @r.async_output = false
+    @r.async_output?.should == false
+    @r.sim_outputs[0].should == 0x0c
+    @r.flush.should == true
+  end
+
+  it 'should count transfers in stats' do
+    @r.reset_stats
+    @r.get_analog(1)
+    @r.set_digital(2, true)
+    s = @r.stats
+    s[:read][:transfers].should >= 1
+    s[:write][:transfers].should == 1
+    s[:write][:histogram].size.should == RubyK8055::LATENCY_BUCKETS.size
+    s[:write][:histogram].inject(:+).should == 1
+  end
+
+  it 'should return the raw packet and packed samples' do
+    @r.sim_inputs(0b10011, 12, 34)
+    raw = @r.read_raw
+    raw.bytesize.should == 8
+    raw.frozen?.should == true
+    buffer = "\0" * (2 * RubyK8055::PACKED_SIZE)
+    @r.read_into(buffer, RubyK8055::PACKED_SIZE).should == buffer.bytesize
+    sample = buffer.unpack(RubyK8055::PACKED_FORMAT + RubyK8055::PACKED_FORMAT)[6, 6]
+    sample[1, 5].should == [0b10011, 12, 34] + @r.all_inputs[7, 2]
+    lambda { @r.read_into(buffer, buffer.bytesize - 1) }.should raise_error(IndexError)
+  end
+
+  it 'should take samples at a fixed interval in one call' do
+    @r.sim_inputs(0b10011, 12, 34)
+    run = @r.acquire(count: 20, interval_us: 2000, channels: [:digital, :analog2])
+    run[:count].should == 20
+    run.key?(:analog1).should == false
+    run[:digital].unpack("C*").uniq.should == [0b10011]
+    run[:analog2].unpack("C*").uniq.should == [34]
+    times = run[:timestamps].unpack("Q<*")
+    ((times.last - times.first) / 1e9).should be_within(0.01).of(0.038)
+    run[:jitter][:max].should >= run[:jitter][:mean]
+    lambda { @r.acquire(count: 1, interval_us: 0, channels: [:analog3]) }.should raise_error(ArgumentError)
+  end
+
+  it 'should stop a killed acquire without disturbing other calls' do
+    t = Thread.new { @r.acquire(count: 1000, interval_us: 10000) }
+    sleep 0.05
+    t.kill.join(1).should == t
+    @r.sim_inputs(0, 56, 0)
+    @r.get_analog(1).should == 56
+    @r.acquire(count: 3, interval_us: 1000)[:count].should == 3
+  end
+
+  it 'should take a new packet for every sample while acquiring' do
+    @r.start_acquisition
+    times = @r.acquire(count: 50, interval_us: 0)[:timestamps].unpack("Q<*")
+    @r.stop_acquisition
+    times.size.should == 50
+    times.each_cons(2).all? { |a, b| b > a }.should == true
+  end
+
+  it 'should filter the analog inputs natively' do
+    @r.analog_filter(1, 4, 0.5).should == true
+    @r.analog_stats(1).should == nil
+    [10, 20, 30, 200, 40].each { |v| @r.sim_inputs(0, v, 0); @r.get_analog(1) }
+    s = @r.analog_stats(1)
+    s[:samples].should == 4
+    s[:mean].should == 72.5
+    s[:median].should == 35
+    [s[:min], s[:max]].should == [20, 200]
+    s[:smoothed].should == 75.625
+    @r.analog_filter(1, 0)
+    @r.analog_stats(1).should == nil
+    lambda { @r.analog_filter(1, 5000) }.should raise_error(ArgumentError)
+    @r.sim_inputs(0b10011, 12, 34)
+  end
+
+  it 'should debounce the digital inputs in software' do
+    @r.sim_inputs(0, 12, 34)
+    @r.get_digital(1).should == 0
+    @r.set_digital_debounce(1, 0, 3).should == true
+    @r.digital_debounce(1).should == [0, 3]
+    glitches = @r.digital_glitches
+    @r.sim_inputs(1, 12, 34)
+    2.times { @r.get_digital(1).should == 0 }
+    @r.sim_inputs(0, 12, 34)
+    @r.get_digital(1).should == 0
+    @r.digital_glitches.should == glitches + 1
+    @r.sim_inputs(1, 12, 34)
+    (@r.read_raw.getbyte(0) & 0x10).should == 0x10
+    [@r.get_digital(1), @r.all_inputs[0]].should == [0, 1]
+    @r.set_digital_debounce(1, 0)
+    @r.sim_inputs(0b10011, 12, 34)
+  end
+
+  it 'should answer reads from a recent packet when read_cache_age is set' do
+    @r.read_cache_age = 0.5
+    @r.get_analog(1)
+    @r.reset_stats
+    (1..4).map { Thread.new { 5.times { @r.get_analog(2) } } }.each(&:join)
+    @r.stats[:read][:transfers].should == 0
+    @r.read_cache_age = 0
+    @r.read_cache_age.should == 0
+  end
+
+  it 'should play an output sequence on a native timer' do
+    frames = (1..5).map { |i| [i, i * 10, 0, 0.01] }
+    @r.play_sequence(frames).should == true
+    @r.playing?.should == true
+    sleep 0.01 while @r.playing?
+    @r.sequence_position.should == 4
+    @r.sim_outputs.should == [5, 50, 0]
+    @r.play_sequence(frames, true)
+    @r.seek_sequence(2).should == true
+    @r.stop_sequence
+    @r.playing?.should == false
+  end
+
+  it 'should reconnect a lost board to play a sequence' do
+    @r.auto_reconnect = true
+    @r.sim_unplug(0.05)
+    lambda { @r.get_analog(1) }.should raise_error(RubyK8055::Error)
+    sleep 0.1
+    @r.play_sequence([[0x11, 1, 2, 0.01]]).should == true
+    sleep 0.01 while @r.playing?
+    @r.sim_outputs.should == [0x11, 1, 2]
+    @r.auto_reconnect = false
+  end
+
+  it 'should report digital input changes as edge events' do
+    @r.sim_inputs(0, 12, 34)
+    edges = Queue.new
+    lambda { @r.on_change(6) { } }.should raise_error(ArgumentError)
+    @r.on_change(2) { |edge, time| edges << [2, edge] }
+    @r.on_edge { |channel, edge, time| edges << [channel, edge] }
+    sleep 0.05
+    @r.sim_inputs(0b00010, 12, 34)
+    Timeout.timeout(1) { [edges.pop, edges.pop] }.should == [[2, :rising], [2, :rising]]
+    @r.stop_events.should == true
+    @r.acquiring?.should == false
+    @r.sim_inputs(0b10011, 12, 34)
+  end
+
+  it 'should deliver edge events again after a reconnect' do
+    r = RubyK8055.new
+    r.connect(1, :sim)
+    r.on_edge { }
+    r.disconnect
+    r.acquiring?.should == false
+    r.connect(1, :sim)
+    edges = Queue.new
+    r.on_edge { |channel, edge, time| edges << [channel, edge] }
+    sleep 0.05
+    r.sim_inputs(0b00100, 0, 0)
+    Timeout.timeout(1) { edges.pop }.should == [3, :rising]
+    r.stop_events.should == true
+    r.disconnect
+  end
+
+  it 'should capture input packets to a ring file' do
+    path = "/tmp/rubyk8055_spec_capture"
+    File.delete(path) if File.exist?(path)
+    @r.start_capture(path, 4).should == true
+    6.times { |i| @r.sim_inputs(0, i, 0); @r.snapshot }
+    @r.stop_capture.should == true
+    RubyK8055.read_capture(path).map { |s| s.analog1 }.should == [2, 3, 4, 5]
+    File.delete(path)
+    @r.sim_inputs(0b10011, 12, 34)
+  end
+
+  it 'should retry transfers that the simulated bus drops' do
+    @r.sim_configure(100, 50, 0.05).should == true
+    20.times { @r.get_analog(1).should == 12 }
+    @r.sim_configure(0)
+  end
+
+  after(:all) do
+    @r.disconnect
+  end
+end